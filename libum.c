@@ -0,0 +1,149 @@
+/**
+ ** libum.c
+ ** Purpose: Implementation of the embedding interface in libum.h on top of
+ ** the um memory and the budgeted threaded engine
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "libum.h"
+#include "um_mem.h"
+#include "um_io.h"
+#include "um_load.h"
+#include "um_threaded.h"
+
+struct UM {
+    umStorage *mem;
+    uint64_t left;                  /* of the budget of the running um_run */
+    bool halted;
+    const char *failure;            /* NULL unless the program failed */
+    char failureText[128];
+    UMInputFn input;
+    UMOutputFn output;
+    void *context;
+    bool callbacks;                 /* false while on stdin and stdout */
+};
+
+static size_t no_input(void *context, uint8_t *buffer, size_t size)
+{
+    (void)context;
+    (void)buffer;
+    (void)size;
+    return 0;
+}
+
+static void discard_output(void *context, const uint8_t *bytes, size_t size)
+{
+    (void)context;
+    (void)bytes;
+    (void)size;
+}
+
+/* gives the machine's memory the I/O the host asked for */
+static void attach_io(UM *um)
+{
+    io_free(um->mem->io);
+    if (um->callbacks) {
+        um->mem->io = io_new_callbacks(um->input ? um->input : no_input,
+                                       um->output ? um->output
+                                                  : discard_output,
+                                       um->context);
+    } else {
+        um->mem->io = io_new(STDIN_FILENO, STDOUT_FILENO);
+    }
+}
+
+UM *um_create(void)
+{
+    UM *um = calloc(1, sizeof(*um));
+    assert(um != NULL);
+    um->mem = initialize_memory();
+    return um;
+}
+
+void um_destroy(UM *um)
+{
+    if (um != NULL) {
+        release_memory(um->mem);
+        free(um);
+    }
+}
+
+int um_load(UM *um, const void *image, size_t size)
+{
+    Segment *program = program_from_bytes(image, size);
+    if (program == NULL) {
+        return -1;
+    }
+    release_memory(um->mem);
+    um->mem = initialize_memory();
+    attach_io(um);
+    add_segment(program, um->mem);
+    um->halted = false;
+    um->failure = NULL;
+    return 0;
+}
+
+void um_set_io(UM *um, UMInputFn input, UMOutputFn output, void *context)
+{
+    um->input = input;
+    um->output = output;
+    um->context = context;
+    um->callbacks = true;
+    attach_io(um);
+}
+
+UMStatus um_run(UM *um, uint64_t budget, uint64_t *executed)
+{
+    assert(is_mapped(um->mem, 0));
+    /* the budget lives in the machine rather than a local, which a failure
+     * jumping back here would leave indeterminate
+     */
+    um->left = budget;
+    if (!um->halted && um->failure == NULL) {
+        /* a failing program fails the machine, not the host */
+        umRecovery recovery;
+        umRecovery *outer = um_recovery;
+        um_recovery = &recovery;
+        if (setjmp(recovery.env) == 0) {
+            um->halted = run_threaded_budgeted(um->mem, &um->left);
+        } else {
+            snprintf(um->failureText, sizeof(um->failureText), "%s",
+                     recovery.failure);
+            um->failure = um->failureText;
+        }
+        um_recovery = outer;
+    }
+    io_flush(um->mem->io);
+    if (executed != NULL) {
+        *executed = budget - um->left;
+    }
+    return um_status(um);
+}
+
+UMStatus um_status(const UM *um)
+{
+    if (um->failure != NULL) {
+        return UM_FAILED;
+    }
+    return um->halted ? UM_HALTED : UM_RUNNING;
+}
+
+const char *um_error(const UM *um)
+{
+    return um->failure;
+}
+
+uint32_t um_register(const UM *um, int index)
+{
+    if (index < 0 || index > 7) {
+        return 0;
+    }
+    return get_reg_val(um->mem, index);
+}
+
+uint32_t um_counter(const UM *um)
+{
+    return um->mem->counter;
+}
\ No newline at end of file
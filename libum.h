@@ -0,0 +1,87 @@
+/**
+ ** libum.h
+ ** Purpose: Stable interface for embedding the um in another program. A
+ ** host creates a machine, loads a program image into it, and runs it for
+ ** as many instructions at a time as it likes, so guest execution can be
+ ** interleaved with the host's own work. Link with libum.a (and the cii40
+ ** library its checked runtime errors are raised through).
+ **/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef LIBUM_H
+#define LIBUM_H
+
+/* A machine; only handled through the functions below */
+typedef struct UM UM;
+
+typedef enum UMStatus {
+    UM_RUNNING = 0,                 /* stopped because the budget ran out */
+    UM_HALTED = 1,                  /* the program ran a halt instruction */
+    UM_FAILED = 2                   /* the program failed; see um_error */
+} UMStatus;
+
+/* budget for um_run that runs until halt */
+#define UM_NO_BUDGET UINT64_MAX
+
+/* Stores up to size bytes of input in buffer and returns how many were
+ * stored, 0 once input has ended (the program then reads all ones).
+ */
+typedef size_t (*UMInputFn)(void *context, uint8_t *buffer, size_t size);
+
+/* Takes size bytes the program has output. */
+typedef void (*UMOutputFn)(void *context, const uint8_t *bytes,
+                           size_t size);
+
+/* Function returns a new machine with no program loaded, reading stdin and
+ * writing stdout until um_set_io is called.
+ */
+UM *um_create(void);
+
+/* Takes in a machine. Function flushes its output and frees it. */
+void um_destroy(UM *um);
+
+/* Takes in a machine and a program image of size bytes holding big-endian
+ * instruction words. Function resets the machine and loads the image as
+ * segment 0. Returns 0, or -1 if the size is not a multiple of 4.
+ */
+int um_load(UM *um, const void *image, size_t size);
+
+/* Takes in a machine, the functions its input is read with and its output
+ * written with (NULL for no input and for discarded output) and a context
+ * passed to both. Output is buffered and handed over before every input
+ * request and whenever um_run returns.
+ */
+void um_set_io(UM *um, UMInputFn input, UMOutputFn output, void *context);
+
+/* Takes in a machine with a program loaded, a number of instructions and a
+ * pointer to store how many ran (or NULL). Function runs the program until
+ * it halts, fails or budget instructions have run, and returns which
+ * happened. Calling it again carries on where it stopped; a halted or
+ * failed machine stays so until the next um_load. When the program fails,
+ * the instructions that ran include the failing one. A failure goes back
+ * to um_run whatever recovery the caller's thread has, and that recovery
+ * is in place again when um_run returns.
+ */
+UMStatus um_run(UM *um, uint64_t budget, uint64_t *executed);
+
+/* Takes in a machine. Function returns whether it has halted or failed. */
+UMStatus um_status(const UM *um);
+
+/* Takes in a machine. Function returns the failure of a machine whose
+ * status is UM_FAILED (such as "division by zero"), or NULL.
+ */
+const char *um_error(const UM *um);
+
+/* Takes in a machine and a register number. Function returns the
+ * register's value, or 0 if the number is not 0-7.
+ */
+uint32_t um_register(const UM *um, int index);
+
+/* Takes in a machine. Function returns the index of the next instruction
+ * of segment 0 it will run.
+ */
+uint32_t um_counter(const UM *um);
+
+#endif
\ No newline at end of file
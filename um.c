@@ -9,152 +9,365 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
-#include <bitpack.h>
+#include <unistd.h>
+#include <inttypes.h>
 #include "um_operations.h"
+#include "um_threaded.h"
+#include "um_jit.h"
+#include "um_load.h"
+#include "um_io.h"
+#include "um_profile.h"
+#include "um_snapshot.h"
+#include "um_batch.h"
+#include "um_diff.h"
+#include "um_trace.h"
 
-const int WORDSIZE = 4;
+/* engine used when none is given with --engine, chosen at build time */
+#ifndef UM_ENGINE
+#define UM_ENGINE "threaded"
+#endif
 
 void load_seg_zero(char *filename, umStorage *mem);
-uint32_t *bitStore(char word[]);
-bool run_instruction(umStorage *mem);
+void run_with_stats(umStorage *mem, const char *destination);
+void run_with_fusion(umStorage *mem, const char *destination);
+void run_loop_published(umStorage *mem);
+void run_profiled(umStorage *mem, const char *engine, int top,
+                  const char *histogram);
+bool run_traced(umStorage *mem, const char *engine, const char *record,
+                const char *replay);
+
+/* machine run by main, whose buffered output is flushed (and whose peak
+ * memory is reported, for --memory) when it halts or exits early
+ */
+static umStorage *running = NULL;
+static bool reportMemory = false;
+
+static void flush_running(void)
+{
+    if (running != NULL) {
+        io_flush(running->io);
+        /* a failing run's trace is kept, to replay up to the failure */
+        if (running->trace != NULL) {
+            trace_close(running->trace, running, false);
+        }
+        if (reportMemory) {
+            umUsage *usage = &running->usage;
+            fprintf(stderr, "memory: peak %" PRIu32 " segments, %" PRIu64
+                    " words, %zu host bytes\n", usage->peakSegments,
+                    usage->peakWords, usage->peakBytes);
+        }
+        running = NULL;
+    }
+}
+
+/* Takes in a size in bytes, with an optional K, M or G suffix. Function
+ * stores it in bytes and returns true, or returns false if it is malformed.
+ */
+static bool parse_size(const char *text, size_t *bytes)
+{
+    char *end = NULL;
+    unsigned long long size = strtoull(text, &end, 10);
+    if (end == text) {
+        return false;
+    }
+    switch (*end) {
+    case 'G': case 'g':
+        size *= 1024;
+        /* fall through */
+    case 'M': case 'm':
+        size *= 1024;
+        /* fall through */
+    case 'K': case 'k':
+        size *= 1024;
+        end++;
+        break;
+    }
+    *bytes = size;
+    return *end == '\0';
+}
 
 int main(int argc, char *argv[])
 {
-    if (argc != 2) {
-        fprintf(stderr, "Usage:     um [filename]\n");
+    const char *engine = UM_ENGINE;
+    char *filename = NULL;
+    bool count = false;
+    const char *stats = NULL;       /* file for --stats, "-" for stderr */
+    const char *fusion = NULL;      /* file for --fusion, "-" for stderr */
+    int profileTop = 0;             /* hot pcs shown by --profile */
+    const char *profileOut = NULL;  /* histogram file for --profile-out */
+    const char *snapshot = NULL;    /* written at halt */
+    const char *restore = NULL;     /* snapshot to resume from */
+    const char *batch = NULL;       /* manifest for --batch */
+    const char *record = NULL;      /* trace written by --record */
+    const char *replay = NULL;      /* trace read by --replay */
+    long long diff = -1;            /* instructions between --diff checks */
+    int jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    size_t maxMem = 0;              /* host bytes allowed, 0 for no limit */
+    bool usage = false;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--engine=", 9) == 0) {
+            engine = argv[i] + 9;
+        } else if (strcmp(argv[i], "--count") == 0) {
+            count = true;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            stats = "-";
+        } else if (strncmp(argv[i], "--stats=", 8) == 0) {
+            stats = argv[i] + 8;
+        } else if (strcmp(argv[i], "--fusion") == 0) {
+            fusion = "-";
+        } else if (strncmp(argv[i], "--fusion=", 9) == 0) {
+            fusion = argv[i] + 9;
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            profileTop = 20;
+        } else if (strncmp(argv[i], "--profile=", 10) == 0) {
+            profileTop = atoi(argv[i] + 10);
+        } else if (strncmp(argv[i], "--profile-out=", 14) == 0) {
+            profileOut = argv[i] + 14;
+        } else if (strncmp(argv[i], "--snapshot=", 11) == 0) {
+            snapshot = argv[i] + 11;
+        } else if (strncmp(argv[i], "--snapshot-signal=", 18) == 0) {
+            snapshot_on_signal(argv[i] + 18);
+        } else if (strncmp(argv[i], "--restore=", 10) == 0) {
+            restore = argv[i] + 10;
+        } else if (strcmp(argv[i], "--restore") == 0 && i + 1 < argc) {
+            restore = argv[++i];
+        } else if (strncmp(argv[i], "--batch=", 8) == 0) {
+            batch = argv[i] + 8;
+        } else if (strcmp(argv[i], "--diff") == 0) {
+            diff = 1000000;
+        } else if (strncmp(argv[i], "--diff=", 7) == 0) {
+            diff = atoll(argv[i] + 7);
+        } else if (strncmp(argv[i], "--jobs=", 7) == 0) {
+            jobs = atoi(argv[i] + 7);
+        } else if (strncmp(argv[i], "--record=", 9) == 0) {
+            record = argv[i] + 9;
+        } else if (strncmp(argv[i], "--replay=", 9) == 0) {
+            replay = argv[i] + 9;
+        } else if (strcmp(argv[i], "--memory") == 0) {
+            reportMemory = true;
+        } else if (strncmp(argv[i], "--max-mem=", 10) == 0) {
+            usage = usage || !parse_size(argv[i] + 10, &maxMem);
+        } else if (filename == NULL) {
+            filename = argv[i];
+        } else {
+            usage = true;
+        }
+    }
+    if (batch != NULL && !usage && filename == NULL && restore == NULL) {
+        int failed = run_batch(batch, engine, jobs, maxMem);
+        return failed == 0 ? 0 : EXIT_FAILURE;
+    }
+    if (diff >= 0 && !usage && filename != NULL && restore == NULL) {
+        int status = run_diff(filename, engine, (uint64_t)diff);
+        return status == 0 ? 0 : EXIT_FAILURE;
+    }
+    if (usage || (filename == NULL) == (restore == NULL)
+        || (record != NULL && replay != NULL)) {
+        fprintf(stderr, "Usage:     um [--engine=loop|threaded|jit] "
+                        "[--count] [--stats[=FILE]]\n"
+                        "           [--fusion[=FILE]] "
+                        "[--profile[=N]] [--profile-out=FILE]\n"
+                        "           [--snapshot=FILE] "
+                        "[--snapshot-signal=FILE]\n"
+                        "           [--memory] [--max-mem=BYTES[K|M|G]]\n"
+                        "           [--record=TRACE | --replay=TRACE]\n"
+                        "           (filename | --restore FILE)\n"
+                        "           um [--engine=NAME] --batch=MANIFEST "
+                        "[--jobs=N] [--max-mem=BYTES]\n"
+                        "           um [--engine=NAME] --diff[=N] "
+                        "filename\n");
         return EXIT_FAILURE;
     }
 
-    umStorage *mem = initialize_memory();
-    load_seg_zero(argv[1], mem);
+    umStorage *mem = NULL;
+    if (restore != NULL) {
+        mem = snapshot_restore(restore);
+        set_usage_limit(mem, maxMem);
+    } else {
+        mem = initialize_memory();
+        set_usage_limit(mem, maxMem);
+        load_seg_zero(filename, mem);
+    }
 
-    /* loops through instructions until halt */
-    bool halt = false;
-    while (!halt) {
-        halt = run_instruction(mem);
+    /* buffered output still reaches stdout when the um exits on an error */
+    running = mem;
+    atexit(flush_running);
+
+    /* output goes out on a thread of its own, so a slow reader of stdout
+     * only holds the um up once a ring of buffers is full
+     */
+    io_start_writer(mem->io);
+
+    if (record != NULL || replay != NULL) {
+        if (!run_traced(mem, engine, record, replay)) {
+            running = NULL;
+            release_memory(mem);
+            return EXIT_FAILURE;
+        }
+    } else if (stats != NULL) {
+        run_with_stats(mem, stats);
+    } else if (fusion != NULL) {
+        run_with_fusion(mem, fusion);
+    } else if (count) {
+        /* counting goes through the loop, so the other engines never pay
+         * for it
+         */
+        unsigned long long executed = 0;
+        bool halt = false;
+        while (!halt) {
+            halt = run_instruction(mem);
+            executed++;
+        }
+        fprintf(stderr, "instructions: %llu\n", executed);
+    } else if (profileTop > 0 || profileOut != NULL) {
+        run_profiled(mem, engine, profileTop, profileOut);
+    } else if (!run_engine(mem, engine)) {
+        fprintf(stderr, "um: unknown engine '%s'\n", engine);
+        running = NULL;
+        release_memory(mem);
+        return EXIT_FAILURE;
+    }
+    flush_running();
+    if (snapshot != NULL && !snapshot_save(mem, snapshot)) {
+        fprintf(stderr, "um: cannot write snapshot %s\n", snapshot);
+        release_memory(mem);
+        return EXIT_FAILURE;
     }
     release_memory(mem);
     
     return 0;
 }
 /* Takes in the name of the input file and a pointer to the um's memory.
- * Creates the zero segment, opens and reads every instruction from the file, 
- * and stores it in the zero segment. It is a checked runtime error that the 
- * file is successfully opened.
+ * Loads the program in the file and maps it as the zero segment.
  */
 void load_seg_zero(char *filename, umStorage *mem)
 {
-    /* creates the segment 0 */
-    Seq_T segZero = Seq_new(0);
-
-    FILE *fp = fopen(filename, "r");
-    assert(fp);
-    char word[WORDSIZE];
-
-    char c = ' ';
-    c = fgetc(fp);
-    while (!feof(fp)) {
-        for (int i = 0; i < WORDSIZE; i++) {
-            word[i] = c;
-            c = fgetc(fp);
-        }
-        Seq_addhi(segZero, bitStore(word));
+    Segment *program = load_program(filename);
+    if (program == NULL) {
+        exit(EXIT_FAILURE);
     }
-    add_segment(segZero, mem);
-    fclose(fp);
-
+    add_segment(program, mem);
 }
-/* Takes in the 4 char word and converts it to a 32 bit value.
- * A pointer is created, with its value being the 32 bit value.
- * pointer is returned. 
+
+/* Takes in a pointer to the um's memory and where the report goes ("-" for
+ * stderr). Runs the program through the loop engine while gathering
+ * execution statistics, and prints them at halt.
  */
-uint32_t *bitStore(char word[])
+void run_with_stats(umStorage *mem, const char *destination)
 {
-    uint32_t instruction = 0;
-    uint32_t mask = 255;
-    uint32_t temp = 0;
-    
-    for (int i = 0; i < WORDSIZE; i++){
-        temp = mask & word[i];
-        temp = temp << 8 * (3 - i);
-        instruction = instruction | temp;
+#ifdef UM_NO_STATS
+    (void)mem;
+    fprintf(stderr, "um: --stats for %s is not available, um was built "
+                    "with UM_NO_STATS\n", destination);
+    exit(EXIT_FAILURE);
+#else
+    umStats stats;
+    memset(&stats, 0, sizeof(stats));
+    bool halt = false;
+    while (!halt) {
+        halt = run_instruction_stats(mem, &stats);
     }
 
-    uint32_t *instPtr = malloc(sizeof(*instPtr));
-    assert(instPtr != NULL);
-    *instPtr = instruction;
-
-    return instPtr;
+    FILE *fp = stderr;
+    if (strcmp(destination, "-") != 0) {
+        fp = fopen(destination, "w");
+        if (fp == NULL) {
+            fprintf(stderr, "um: cannot write %s\n", destination);
+            exit(EXIT_FAILURE);
+        }
+    }
+    stats_print(&stats, fp);
+    if (fp != stderr) {
+        fclose(fp);
+    }
+#endif
 }
-/* Takes in a pointer to the um's memory. Function gets the next instruction
- * from segment 0 and finds the op code, extracts necessary values (depending
- * on op code) and calls the corrosponding um operation.
- * Returns true after operation is executed, and false if the op code = halt
+
+/* Takes in a pointer to the um's memory and where the report goes ("-" for
+ * stderr). Runs the program through the threaded engine while counting the
+ * instruction pairs it runs fused, and prints the fusion hit rate at halt.
  */
-bool run_instruction(umStorage *mem)
+void run_with_fusion(umStorage *mem, const char *destination)
 {
-    uint32_t instruction = get_next_instruction(mem);
+    umFusion fusion;
+    memset(&fusion, 0, sizeof(fusion));
+    run_threaded_fusion(mem, &fusion);
 
-    uint32_t opCode = instruction >> 28; 
+    FILE *fp = stderr;
+    if (strcmp(destination, "-") != 0) {
+        fp = fopen(destination, "w");
+        if (fp == NULL) {
+            fprintf(stderr, "um: cannot write %s\n", destination);
+            exit(EXIT_FAILURE);
+        }
+    }
+    fusion_print(&fusion, fp);
+    if (fp != stderr) {
+        fclose(fp);
+    }
+}
 
-    if (opCode == 13) {
-        uint32_t a = 7;
-        a = a << 25;
-        a = (a & instruction) >> 25;
-        uint32_t value = 33554431;   /* 25 ones in binary */
-        value = value & instruction;
-        loadVal(mem, value, a);
+/* Takes in a pointer to the um's memory. Runs the program with the loop
+ * engine, storing the program and pc of every instruction in
+ * mem->executing before running it, as the profiled threaded engine does.
+ */
+void run_loop_published(umStorage *mem)
+{
+    bool halt = false;
+    while (!halt) {
+        *(volatile uint64_t *)&mem->executing =
+            (uint64_t)mem->programID << 32 | mem->counter;
+        halt = run_instruction(mem);
     }
+}
 
-    else{
-        uint32_t a = ((7 << 6) & instruction) >> 6;
-        uint32_t b = ((7 << 3) & instruction) >> 3;
-        uint32_t c = 7 & instruction;
+/* Takes in a pointer to the um's memory, the engine asked for, how many hot
+ * pcs to report and a file for the full histogram (or NULL). Runs the
+ * program under the sampling profiler, with the loop engine if it was
+ * asked for and the profiled threaded engine otherwise, since the jit does
+ * not keep the program counter in memory.
+ */
+void run_profiled(umStorage *mem, const char *engine, int top,
+                  const char *histogram)
+{
+    profile_start(mem, 1000);
+    if (strcmp(engine, "loop") == 0) {
+        run_loop_published(mem);
+    } else {
+        run_threaded_profiled(mem);
+    }
+    profile_stop();
 
-        if (opCode == 0){
-            cMove(mem, a, b, c);
-        }
-        else if (opCode == 1){
-            segLoad(mem, a, b, c);
-        }
-        else if (opCode == 2){
-            segStore(mem, a, b, c);
-        }
-        else if (opCode == 3){
-            add(mem, a, b, c);
-        }
-        else if (opCode == 4){
-            multiply(mem, a, b, c); 
-        }
-        else if (opCode == 5){
-            divide(mem, a, b, c);
-        }
-        else if (opCode == 6){
-            nand(mem, a, b, c);
-        }
-        else if (opCode == 7){
-            return true;    
-        }
-        else if (opCode == 8){
-            mapSegment(mem, b, c);
-        }
-        else if (opCode == 9){
-            unmapSegment(mem, c);
-        }   
-        else if (opCode == 10){
-            output(mem, c);
-        }
-        else if (opCode == 11){
-            input(mem, c);
-        }
-        else if (opCode == 12){
-            loadProgram(mem, b, c);
-        }
-        else {
-            fprintf(stderr, "Unkown Command\n");
-            return true;
-        }
+    if (top > 0) {
+        profile_report(mem, top, stderr);
+    }
+    if (histogram != NULL && !profile_write(histogram)) {
+        fprintf(stderr, "um: cannot write %s\n", histogram);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Takes in a pointer to the um's memory, the engine asked for and the trace
+ * to record or to replay (the other is NULL). Runs the program with the
+ * trace attached, through the loop engine if it was asked for and the
+ * threaded engine that keeps the pc being run in memory otherwise, since
+ * every event is recorded with its program counter. Returns false if the
+ * trace could not be opened or written.
+ */
+bool run_traced(umStorage *mem, const char *engine, const char *record,
+                const char *replay)
+{
+    umTrace *trace = record != NULL ? trace_record(mem, record)
+                                    : trace_replay(mem, replay);
+    if (trace == NULL) {
+        return false;
+    }
+    if (strcmp(engine, "loop") == 0) {
+        run_loop_published(mem);
+    } else {
+        run_threaded_profiled(mem);
     }
-    return false;
+    return trace_close(trace, mem, true);
 }
\ No newline at end of file
@@ -0,0 +1,378 @@
+/**
+ ** um2c.c
+ ** Purpose: Ahead of time translator from um program images to C. Segment 0
+ ** becomes a function for every AOT_CHUNK words, with a case of a switch for
+ ** every word, so a jump is a switch on its target and everything else runs
+ ** straight through, on registers held in locals. A loadval followed by a
+ ** jump through the same register jumps straight to its target's label. The
+ ** C is built against the runtime in um_aot.c and libum.a, which runs
+ ** whatever the compiled code cannot in the threaded engine. Programs that
+ ** keep data in segment 0 go on in compiled code: only a store that changes
+ ** a compiled word makes code stale, and the runtime interprets the stale
+ ** instructions alone. Programs that load their code into another segment
+ ** (as sandmark does) can have that code compiled too, taken from segment 0
+ ** of a snapshot made after the load.
+ **/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include "um_load.h"
+#include "um_snapshot.h"
+#include "um_aot.h"
+
+/* most programs one translation holds: the image and its snapshots */
+#define MAX_PROGRAMS 16
+
+typedef struct Program {
+    const char *name;
+    const uint32_t *words;
+    uint32_t length;
+    bool *target;                   /* jumped to straight from a loadval */
+    uint32_t *region;               /* of each word, as in um_aot.h */
+    uint32_t regions;
+} Program;
+
+/* what every translation starts with: the macros a chunk leaves through,
+ * with the registers written back for the runtime
+ */
+static const char prelude[] =
+    "#include \"um_aot.h\"\n"
+    "\n"
+    "/* every case falls through into the next word, and a chunk without\n"
+    " * jumps never goes back to dispatch\n"
+    " */\n"
+    "#pragma GCC diagnostic ignored \"-Wimplicit-fallthrough\"\n"
+    "#pragma GCC diagnostic ignored \"-Wunused-label\"\n"
+    "\n"
+    "#define LEAVE(pc, why) do {                             \\\n"
+    "        target = (pc);                                   \\\n"
+    "        status = (why);                                  \\\n"
+    "        goto leave;                                      \\\n"
+    "    } while (0)\n"
+    "\n"
+    "#define SAVE() do {                                     \\\n"
+    "        mem->registers[0] = r0; mem->registers[1] = r1;  \\\n"
+    "        mem->registers[2] = r2; mem->registers[3] = r3;  \\\n"
+    "        mem->registers[4] = r4; mem->registers[5] = r5;  \\\n"
+    "        mem->registers[6] = r6; mem->registers[7] = r7;  \\\n"
+    "    } while (0)\n";
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: um2c [-o output.c] [-s snapshot]... "
+                    "program.um\n");
+    exit(EXIT_FAILURE);
+}
+
+/* Takes in a program and a pc. Function returns true if the word at the pc
+ * is a loadval whose register the loadProgram after it jumps through, to a
+ * target that is then known here.
+ */
+static bool known_jump(const Program *p, uint32_t pc)
+{
+    if (pc + 1 >= p->length || p->words[pc] >> 28 != 13
+        || p->words[pc + 1] >> 28 != 12) {
+        return false;
+    }
+    uint32_t a = (p->words[pc] >> 25) & 7;
+    uint32_t next = p->words[pc + 1];
+    return (next & 7) == a && ((next >> 3) & 7) != a;
+}
+
+/* Takes in a program. Function marks the pcs that get a label, being the
+ * target of a known jump from the same chunk, and splits the words into
+ * regions that each end with a jump or a halt.
+ */
+static void find_targets(Program *p)
+{
+    p->target = calloc(p->length, sizeof(bool));
+    p->region = malloc(p->length * sizeof(uint32_t));
+    assert(p->target != NULL && p->region != NULL);
+    p->regions = 0;
+    for (uint32_t pc = 0; pc < p->length; pc++) {
+        uint32_t value = p->words[pc] & 0x1ffffff;
+        if (known_jump(p, pc) && value < p->length
+            && value / AOT_CHUNK == pc / AOT_CHUNK) {
+            p->target[value] = true;
+        }
+        p->region[pc] = p->regions;
+        if (p->words[pc] >> 28 == 7 || p->words[pc] >> 28 == 12) {
+            p->regions++;
+        }
+    }
+    p->regions++;
+}
+
+/* Takes in the output, a program, its index and a pc. Function writes the
+ * C for the word at the pc. The registers are the locals r0 to r7, and
+ * every case falls through into the next one.
+ */
+static void translate(FILE *out, const Program *p, int index, uint32_t pc)
+{
+    uint32_t word = p->words[pc];
+    uint32_t op = word >> 28;
+    uint32_t a = (word >> 6) & 7;
+    uint32_t b = (word >> 3) & 7;
+    uint32_t c = word & 7;
+
+    fprintf(out, "    case %u:", pc);
+    if (p->target[pc]) {
+        fprintf(out, " L%u:", pc);
+    }
+    fprintf(out, "\n        ");
+    switch (op) {
+    case 0:
+        fprintf(out, "if (r%u != 0) r%u = r%u;", c, a, b);
+        break;
+    case 1:
+        fprintf(out, "r%u = aot_load(mem, r%u, r%u);", a, b, c);
+        break;
+    case 2:
+        fprintf(out, "if (r%u != 0) aot_store(mem, r%u, r%u, r%u);\n"
+                     "        else if (aot_store_code(mem, self, r%u, r%u, "
+                     "%u)) LEAVE(%u, AOT_STOP);", a, a, b, c, b, c, pc,
+                pc + 1);
+        break;
+    case 3:
+        fprintf(out, "r%u = r%u + r%u;", a, b, c);
+        break;
+    case 4:
+        fprintf(out, "r%u = r%u * r%u;", a, b, c);
+        break;
+    case 5:
+        fprintf(out, "um_check(r%u != 0, \"division by zero\");\n"
+                     "        r%u = r%u / r%u;", c, a, b, c);
+        break;
+    case 6:
+        fprintf(out, "r%u = ~(r%u & r%u);", a, b, c);
+        break;
+    case 7:
+        fprintf(out, "LEAVE(%u, AOT_HALT);", pc + 1);
+        break;
+    case 8:
+        fprintf(out, "r%u = aot_map(mem, r%u);", b, c);
+        break;
+    case 9:
+        fprintf(out, "aot_unmap(mem, r%u);", c);
+        break;
+    case 10:
+        fprintf(out, "aot_output(mem, r%u);", c);
+        break;
+    case 11:
+        fprintf(out, "r%u = io_get(mem->io);", c);
+        break;
+    case 12:
+        fprintf(out, "if (r%u != 0) LEAVE(%u, AOT_STOP);\n"
+                     "        target = r%u;\n"
+                     "        goto dispatch;", b, pc, c);
+        break;
+    case 13: {
+        uint32_t value = word & 0x1ffffff;
+        fprintf(out, "r%u = %uu;", (word >> 25) & 7, value);
+        if (known_jump(p, pc)) {
+            uint32_t next = p->words[pc + 1];
+            fprintf(out, "\n        if (r%u != 0) LEAVE(%u, AOT_STOP);",
+                    (next >> 3) & 7, pc + 1);
+            if (value >= p->length) {
+                fprintf(out, "\n        um_fail(\"loadProgram jumped "
+                             "outside segment 0\");");
+            } else if (value / AOT_CHUNK == pc / AOT_CHUNK) {
+                fprintf(out, "\n        if (stale%d[%u] > %u) "
+                             "LEAVE(%u, AOT_STOP);"
+                             "\n        goto L%u;", index, p->region[value],
+                        value, value, value);
+            } else {
+                fprintf(out, "\n        LEAVE(%u, AOT_NEXT);", value);
+            }
+        }
+        break;
+    }
+    default:
+        /* left to the interpreter, which reports it */
+        fprintf(out, "LEAVE(%u, AOT_STOP);", pc);
+        break;
+    }
+    fprintf(out, "\n");
+}
+
+/* Takes in the output, a program, its index and the first pc of a chunk.
+ * Function writes the function running the chunk. A jump out of the chunk
+ * leaves it for the runtime, which calls the chunk holding the target.
+ */
+static void write_chunk(FILE *out, const Program *p, int index,
+                        uint32_t start)
+{
+    uint32_t end = start + AOT_CHUNK < p->length ? start + AOT_CHUNK
+                                                 : p->length;
+    fprintf(out, "\nstatic int chunk%d_%u(umStorage *mem, "
+                 "const umCompiled *self, uint32_t *pc)\n{\n",
+            index, start / AOT_CHUNK);
+    fprintf(out, "    uint32_t r0 = mem->registers[0], "
+                 "r1 = mem->registers[1];\n"
+                 "    uint32_t r2 = mem->registers[2], "
+                 "r3 = mem->registers[3];\n"
+                 "    uint32_t r4 = mem->registers[4], "
+                 "r5 = mem->registers[5];\n"
+                 "    uint32_t r6 = mem->registers[6], "
+                 "r7 = mem->registers[7];\n"
+                 "    uint32_t target = *pc;\n"
+                 "    int status = AOT_NEXT;\n"
+                 "    (void)self;\n\n"
+                 "dispatch:\n");
+    fprintf(out, "    if (target - %uu >= %uu) LEAVE(target, AOT_NEXT);\n"
+                 "    if (stale%d[region%d[target]] > target) "
+                 "LEAVE(target, AOT_STOP);\n"
+                 "    switch (target) {\n", start, end - start, index, index);
+    for (uint32_t pc = start; pc < end; pc++) {
+        translate(out, p, index, pc);
+    }
+    if (end == p->length) {
+        fprintf(out, "        um_fail(\"program counter ran off the end of "
+                     "segment 0\");\n");
+    } else {
+        fprintf(out, "        LEAVE(%u, AOT_NEXT);\n", end);
+    }
+    fprintf(out, "    }\n\n"
+                 "leave:\n"
+                 "    SAVE();\n"
+                 "    *pc = target;\n"
+                 "    return status;\n"
+                 "}\n");
+}
+
+/* Takes in the output, a program and its index. Function writes the words
+ * of the program, its regions and the functions running it.
+ */
+static void write_program(FILE *out, const Program *p, int index)
+{
+    fprintf(out, "\n/* %s: %u words */\n", p->name, p->length);
+    fprintf(out, "static const uint32_t words%d[%u] = {", index, p->length);
+    for (uint32_t pc = 0; pc < p->length; pc++) {
+        fprintf(out, "%s0x%08x%s", pc % 6 == 0 ? "\n    " : " ",
+                p->words[pc], pc + 1 < p->length ? "," : "");
+    }
+    fprintf(out, "\n};\n\n");
+
+    fprintf(out, "static const uint32_t region%d[%u] = {", index, p->length);
+    for (uint32_t pc = 0; pc < p->length; pc++) {
+        fprintf(out, "%s%u%s", pc % 12 == 0 ? "\n    " : " ",
+                p->region[pc], pc + 1 < p->length ? "," : "");
+    }
+    fprintf(out, "\n};\n\n");
+    fprintf(out, "static uint32_t stale%d[%u];\n", index, p->regions);
+
+    for (uint32_t start = 0; start < p->length; start += AOT_CHUNK) {
+        write_chunk(out, p, index, start);
+    }
+
+    fprintf(out, "\nstatic const umChunk chunks%d[] = {", index);
+    for (uint32_t start = 0; start < p->length; start += AOT_CHUNK) {
+        uint32_t chunk = start / AOT_CHUNK;
+        fprintf(out, "%schunk%d_%u%s", chunk % 4 == 0 ? "\n    " : " ",
+                index, chunk, start + AOT_CHUNK < p->length ? "," : "");
+    }
+    fprintf(out, "\n};\n");
+}
+
+/* Takes in the output and the programs. Function writes the whole
+ * translation: the prelude, every program, and main handing them to the
+ * runtime.
+ */
+static void write_translation(FILE *out, Program *programs, int count)
+{
+    fprintf(out, "/* Translated from %s by um2c. Build with libum.a, as "
+                 "'make NAME.native' does. */\n\n", programs[0].name);
+    fputs(prelude, out);
+    for (int i = 0; i < count; i++) {
+        write_program(out, &programs[i], i);
+    }
+    fprintf(out, "\nint main(int argc, char *argv[])\n{\n"
+                 "    static const umCompiled programs[] = {\n");
+    for (int i = 0; i < count; i++) {
+        fprintf(out, "        { words%d, %u, region%d, stale%d, %u, "
+                     "chunks%d }%s\n", i, programs[i].length, i, i,
+                programs[i].regions, i, i + 1 < count ? "," : "");
+    }
+    fprintf(out, "    };\n"
+                 "    return aot_main(argc, argv, programs, %d);\n"
+                 "}\n", count);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *output = NULL;
+    const char *snapshots[MAX_PROGRAMS - 1];
+    int snapshotCount = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "o:s:")) != -1) {
+        switch (opt) {
+        case 'o':
+            output = optarg;
+            break;
+        case 's':
+            if (snapshotCount == MAX_PROGRAMS - 1) {
+                fprintf(stderr, "um2c: at most %d snapshots\n",
+                        MAX_PROGRAMS - 1);
+                return EXIT_FAILURE;
+            }
+            snapshots[snapshotCount++] = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind + 1 != argc) {
+        usage();
+    }
+
+    Program programs[MAX_PROGRAMS];
+    int count = 0;
+    Segment *image = load_program(argv[optind]);
+    if (image == NULL) {
+        return EXIT_FAILURE;
+    }
+    programs[count].name = argv[optind];
+    programs[count].words = image->words;
+    programs[count].length = image->length;
+    count++;
+    for (int i = 0; i < snapshotCount; i++) {
+        umStorage *mem = snapshot_restore(snapshots[i]);
+        if (!is_mapped(mem, 0)) {
+            fprintf(stderr, "um2c: %s has no segment 0\n", snapshots[i]);
+            return EXIT_FAILURE;
+        }
+        programs[count].name = snapshots[i];
+        programs[count].words = mem->program;
+        programs[count].length = mem->programLength;
+        count++;
+    }
+    for (int i = 0; i < count; i++) {
+        if (programs[i].length == 0) {
+            fprintf(stderr, "um2c: %s has no instructions\n",
+                    programs[i].name);
+            return EXIT_FAILURE;
+        }
+        find_targets(&programs[i]);
+    }
+
+    FILE *out = stdout;
+    if (output != NULL) {
+        out = fopen(output, "w");
+        if (out == NULL) {
+            fprintf(stderr, "um2c: cannot write %s\n", output);
+            return EXIT_FAILURE;
+        }
+    }
+    write_translation(out, programs, count);
+    if (fclose(out) != 0) {
+        fprintf(stderr, "um2c: cannot write %s\n",
+                output != NULL ? output : "the output");
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
\ No newline at end of file
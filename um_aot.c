@@ -0,0 +1,151 @@
+/**
+ ** um_aot.c
+ ** Purpose: Implementation of the runtime of programs translated by um2c.
+ ** The machine is the one every engine runs on, so a compiled function and
+ ** the threaded engine can take over from each other at any instruction:
+ ** both keep the registers and the program counter in umStorage between
+ ** them.
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "um_aot.h"
+#include "um_operations.h"
+#include "um_threaded.h"
+
+/* machine whose buffered output is flushed when the program exits early */
+static umStorage *running = NULL;
+
+static void flush_running(void)
+{
+    if (running != NULL) {
+        io_flush(running->io);
+        running = NULL;
+    }
+}
+
+uint32_t aot_map(umStorage *mem, uint32_t length)
+{
+    return add_segment(new_segment(length), mem);
+}
+
+void aot_unmap(umStorage *mem, uint32_t identifier)
+{
+    um_check(identifier != 0, "unmap of segment 0");
+    remove_segment(mem, identifier);
+}
+
+/* Takes in the um's memory and a compiled program held in segment 0.
+ * Function runs the program from the program counter, chunk by chunk, and
+ * returns true at halt, or false with the counter on an instruction the
+ * compiled code left to the interpreter.
+ */
+static bool run_compiled(umStorage *mem, const umCompiled *program)
+{
+    uint32_t pc = mem->counter;
+    int status = AOT_NEXT;
+    while (status == AOT_NEXT) {
+        um_check(pc < program->length, "loadProgram jumped outside segment 0");
+        status = program->chunks[pc / AOT_CHUNK](mem, program, &pc);
+    }
+    mem->counter = pc;
+    return status == AOT_HALT;
+}
+
+/* Takes in the um's memory just after a loadProgram and the compiled
+ * programs. Function returns the one to run segment 0 with: of those as
+ * long as it, the one with the fewest words that differ from segment 0,
+ * with those words stale. Returns NULL if none is as long, or if even the
+ * closest differs in most of its words, since stepping through stale code
+ * one instruction at a time is far slower than the threaded engine.
+ */
+static const umCompiled *attach_compiled(umStorage *mem,
+                                         const umCompiled *programs,
+                                         int count)
+{
+    const umCompiled *closest = NULL;
+    uint32_t fewest = 0;
+    for (int i = 0; i < count && (closest == NULL || fewest > 0); i++) {
+        const umCompiled *program = &programs[i];
+        if (program->length != mem->programLength) {
+            continue;
+        }
+        uint32_t differ = 0;
+        for (uint32_t pc = 0; pc < program->length; pc++) {
+            differ += mem->program[pc] != program->words[pc];
+        }
+        if (closest == NULL || differ < fewest) {
+            closest = program;
+            fewest = differ;
+        }
+    }
+    if (closest == NULL || fewest > closest->length / 2) {
+        return NULL;
+    }
+
+    memset(closest->stale, 0, closest->regions * sizeof(uint32_t));
+    for (uint32_t pc = 0; pc < closest->length; pc++) {
+        if (mem->program[pc] != closest->words[pc]) {
+            closest->stale[closest->region[pc]] = pc + 1;
+        }
+    }
+    return closest;
+}
+
+int aot_main(int argc, char *argv[], const umCompiled *programs, int count)
+{
+    bool interpret = argc == 2 && strcmp(argv[1], "--interpret") == 0;
+    if (argc > 1 && !interpret) {
+        fprintf(stderr, "Usage: %s [--interpret] < input\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    umStorage *mem = initialize_memory();
+    Segment *image = new_segment(programs[0].length);
+    memcpy(image->words, programs[0].words,
+           programs[0].length * sizeof(uint32_t));
+    add_segment(image, mem);
+    running = mem;
+    atexit(flush_running);
+    io_start_writer(mem->io);
+
+    /* the compiled code hands over one instruction at a time, and hands
+     * over for good when a loadProgram leaves no program to run
+     */
+    const umCompiled *current = interpret ? NULL : &programs[0];
+    bool halted = false;
+    while (current != NULL && !halted) {
+        if (run_compiled(mem, current)) {
+            halted = true;
+            continue;
+        }
+        uint32_t word = mem->program[mem->counter];
+        uint32_t b = (word >> 3) & 7;
+        if (word >> 28 == 12 && get_reg_val(mem, b) != 0) {
+            mem->counter++;
+            loadProgram(mem, b, word & 7);
+            current = attach_compiled(mem, programs, count);
+        } else {
+            /* a store into segment 0 the interpreter runs makes compiled
+             * code stale just as one the compiled code runs does
+             */
+            bool code = word >> 28 == 2
+                        && get_reg_val(mem, (word >> 6) & 7) == 0;
+            uint32_t offset = get_reg_val(mem, b);
+            uint64_t one = 1;
+            halted = run_threaded_budgeted(mem, &one);
+            if (code && offset < current->length
+                && mem->program[offset] != current->words[offset]) {
+                aot_make_stale(current, offset, offset);
+            }
+        }
+    }
+    if (!halted) {
+        run_threaded(mem);
+    }
+
+    flush_running();
+    release_memory(mem);
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,146 @@
+/**
+ ** um_aot.h
+ ** Purpose: Interface for the runtime of programs translated into C by
+ ** um2c. A translated program is a function for every chunk of the words of
+ ** segment 0, with a case for every word and the registers in locals, and
+ ** this runtime sets up the machine, runs those functions and hands
+ ** anything they cannot run to the threaded engine.
+ **/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "um_mem.h"
+
+#ifndef UM_AOT_H
+#define UM_AOT_H
+
+/* words of segment 0 compiled into each function */
+#define AOT_CHUNK 1024
+
+/* what a compiled function returns */
+enum {
+    AOT_NEXT,                       /* carry on at the pc */
+    AOT_HALT,                       /* halted */
+    AOT_STOP                        /* interpret the instruction at the pc */
+};
+
+struct umCompiled;
+
+/* A function running one chunk of a program, from *pc with the registers
+ * in mem->registers. It leaves both there when it returns: AOT_NEXT when
+ * the program goes on in another chunk, AOT_HALT at halt, and AOT_STOP on
+ * an instruction only the interpreter can run, being a stale one, a
+ * loadProgram of another segment, or one with an unknown op code.
+ */
+typedef int (*umChunk)(umStorage *mem, const struct umCompiled *self,
+                       uint32_t *pc);
+
+/* A program compiled by um2c: the words it was compiled from and a function
+ * for every AOT_CHUNK of them (the C compiler takes far too long over one
+ * function for a large program). The words are split into regions, each
+ * ending with a jump or a halt, so that a region entered anywhere runs
+ * straight to its end. A store into segment 0 that changes a compiled word
+ * makes the words of its region up to and including that one stale, since
+ * code entered at any of them runs into the changed word; the words after
+ * it stay compiled. stale[r] is one past the last stale word of region r,
+ * or 0.
+ */
+typedef struct umCompiled {
+    const uint32_t *words;
+    uint32_t length;
+    const uint32_t *region;         /* of each word */
+    uint32_t *stale;                /* of each region */
+    uint32_t regions;
+    const umChunk *chunks;
+} umCompiled;
+
+/* Takes in the arguments of a translated program and the programs compiled
+ * into it, the first of them the image it starts with. Function runs the
+ * image with stdin and stdout as its input and output. It runs compiled
+ * code while segment 0 holds one of the programs, or a program as long as
+ * one with fewer than half of its words changed (those are stale from the
+ * start), and the threaded engine otherwise ('--interpret' runs it all in
+ * the threaded engine). Returns the program's exit status.
+ */
+int aot_main(int argc, char *argv[], const umCompiled *programs, int count);
+
+/* Takes in the um's memory, a segment identifier and an offset. Function
+ * returns the word of a segment load. It is a um failure if the segment is
+ * not mapped or the offset is out of bounds.
+ */
+static inline uint32_t aot_load(umStorage *mem, uint32_t identifier,
+                                uint32_t offset)
+{
+    Segment *seg = get_segment(mem, identifier);
+    um_check(offset < seg->length, "segment load out of bounds");
+    return seg->words[offset];
+}
+
+/* Takes in the um's memory, a segment identifier, an offset and a word.
+ * Function stores the word as a segment store does, copying the segment
+ * first if it is shared with another identifier. A store into segment 0
+ * goes through aot_store_code.
+ */
+static inline void aot_store(umStorage *mem, uint32_t identifier,
+                             uint32_t offset, uint32_t value)
+{
+    Segment *seg = get_segment(mem, identifier);
+    if (seg->refs > 1) {
+        seg = get_writable_segment(mem, identifier);
+    }
+    um_check(offset < seg->length, "segment store out of bounds");
+    seg->words[offset] = value;
+}
+
+/* Takes in the compiled program running, an offset into segment 0 whose
+ * word a store has just changed from the program's, and the pc of the
+ * store. Function makes the words of its region up to and including that
+ * one stale, and returns true if the changed word lies ahead of the store
+ * in its region, so the straight line the store is on cannot go on.
+ */
+static inline bool aot_make_stale(const umCompiled *program, uint32_t offset,
+                                  uint32_t pc)
+{
+    uint32_t region = program->region[offset];
+    if (program->stale[region] <= offset) {
+        program->stale[region] = offset + 1;
+    }
+    return region == program->region[pc] && offset > pc;
+}
+
+/* Takes in the um's memory, the compiled program running, an offset into
+ * segment 0, a word and the pc of the store. Function stores the word into
+ * segment 0, and if that changes a word of the program, makes the code
+ * that runs into the word stale. Returns true if the straight line the
+ * store is on cannot go on, as aot_make_stale does.
+ */
+static inline bool aot_store_code(umStorage *mem, const umCompiled *program,
+                                  uint32_t offset, uint32_t value,
+                                  uint32_t pc)
+{
+    aot_store(mem, 0, offset, value);
+    invalidate_instruction(mem, offset);
+    return value != program->words[offset]
+           && aot_make_stale(program, offset, pc);
+}
+
+/* Takes in the um's memory and a length. Function maps a new segment of
+ * that many words and returns its identifier.
+ */
+uint32_t aot_map(umStorage *mem, uint32_t length);
+
+/* Takes in the um's memory and a segment identifier. Function unmaps the
+ * segment. It is a um failure to unmap segment 0 or an unmapped segment.
+ */
+void aot_unmap(umStorage *mem, uint32_t identifier);
+
+/* Takes in the um's memory and a value. Function outputs the value. It is
+ * a um failure if it is above 255.
+ */
+static inline void aot_output(umStorage *mem, uint32_t value)
+{
+    um_check(value < 256, "output of a value above 255");
+    io_put(mem->io, value);
+}
+
+#endif
\ No newline at end of file
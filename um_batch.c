@@ -0,0 +1,280 @@
+/**
+ ** um_batch.c
+ ** Purpose: Implementation of the batch runner. Jobs are dealt round robin
+ ** onto one deque per worker thread. A worker takes jobs from the back of
+ ** its own deque and, once that is empty, steals from the front of the
+ ** others, so a worker stuck on a long program does not hold up the jobs
+ ** queued behind it. Jobs never create jobs, so a worker that finds every
+ ** deque empty is done.
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "um_batch.h"
+#include "um_operations.h"
+#include "um_load.h"
+
+typedef struct Job {
+    char *program;
+    char *input;                    /* NULL reads nothing */
+    char *output;                   /* NULL discards output */
+    double seconds;
+    size_t peakBytes;               /* host memory the machine peaked at */
+    const char *status;
+    char failure[160];              /* status of a program that failed */
+} Job;
+
+typedef struct Deque {
+    pthread_mutex_t lock;
+    int *jobs;                      /* indices into the job array */
+    int head;                       /* thieves take from here */
+    int tail;                       /* the owner takes from here */
+} Deque;
+
+typedef struct Pool {
+    Job *jobs;
+    Deque *deques;
+    int workers;
+    const char *engine;
+    size_t maxMem;                  /* host bytes per machine, 0 for any */
+} Pool;
+
+typedef struct Worker {
+    Pool *pool;
+    int self;
+} Worker;
+
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* returns a copy of the field, or NULL for "-" */
+static char *field(const char *text)
+{
+    if (strcmp(text, "-") == 0) {
+        return NULL;
+    }
+    char *copy = strdup(text);
+    assert(copy != NULL);
+    return copy;
+}
+
+/* Takes in an open manifest. Function returns the array of jobs it lists
+ * and stores their number in count, or returns NULL on a malformed line.
+ */
+static Job *read_manifest(FILE *fp, const char *name, int *count)
+{
+    int capacity = 64;
+    Job *jobs = malloc(capacity * sizeof(*jobs));
+    assert(jobs != NULL);
+    *count = 0;
+
+    char line[4096];
+    for (int number = 1; fgets(line, sizeof(line), fp) != NULL; number++) {
+        char program[4096], input[4096], output[4096];
+        char *start = line + strspn(line, " \t");
+        if (*start == '#' || *start == '\n' || *start == '\0') {
+            continue;
+        }
+        if (sscanf(start, "%4095s %4095s %4095s", program, input,
+                   output) != 3) {
+            fprintf(stderr, "um: %s:%d: expected a program, an input and "
+                            "an output\n", name, number);
+            free(jobs);
+            return NULL;
+        }
+        if (*count == capacity) {
+            capacity *= 2;
+            jobs = realloc(jobs, capacity * sizeof(*jobs));
+            assert(jobs != NULL);
+        }
+        Job *job = &jobs[(*count)++];
+        job->program = field(program);
+        job->input = field(input);
+        job->output = field(output);
+        job->seconds = 0.0;
+        job->peakBytes = 0;
+        job->status = "not run";
+    }
+    return jobs;
+}
+
+/* Takes in a job, an engine and a memory limit. Function runs the job's
+ * program on a machine of its own, with input and output on the job's
+ * files.
+ */
+static void run_job(Job *job, const char *engine, size_t maxMem)
+{
+    double start = now();
+    int in = open(job->input ? job->input : "/dev/null", O_RDONLY);
+    int out = open(job->output ? job->output : "/dev/null",
+                   O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    Segment *program = NULL;
+    if (in < 0) {
+        job->status = "cannot open input";
+    } else if (out < 0) {
+        job->status = "cannot open output";
+    } else if (job->program == NULL
+               || (program = load_program(job->program)) == NULL) {
+        job->status = "cannot load program";
+    } else {
+        umStorage *mem = initialize_memory();
+        io_free(mem->io);
+        mem->io = io_new(in, out);
+        /* added before the limit is set, so the machine owns the program
+         * (and frees it) even when the limit fails the job at once
+         */
+        add_segment(program, mem);
+
+        /* a failing program ends its own job, not the whole batch */
+        umRecovery recovery;
+        um_recovery = &recovery;
+        if (setjmp(recovery.env) == 0) {
+            set_usage_limit(mem, maxMem);
+            job->status = run_engine(mem, engine) ? "ok" : "unknown engine";
+        } else {
+            snprintf(job->failure, sizeof(job->failure), "failed: %s",
+                     recovery.failure);
+            job->status = job->failure;
+        }
+        um_recovery = NULL;
+        job->peakBytes = mem->usage.peakBytes;
+        release_memory(mem);
+    }
+    if (in >= 0) {
+        close(in);
+    }
+    if (out >= 0) {
+        close(out);
+    }
+    job->seconds = now() - start;
+}
+
+/* takes the newest job off the worker's own deque, or -1 */
+static int pop(Deque *deque)
+{
+    int job = -1;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->head < deque->tail) {
+        job = deque->jobs[--deque->tail];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return job;
+}
+
+/* takes the oldest job off another worker's deque, or -1 */
+static int steal(Deque *deque)
+{
+    int job = -1;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->head < deque->tail) {
+        job = deque->jobs[deque->head++];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return job;
+}
+
+static void *work(void *argument)
+{
+    Worker *worker = argument;
+    Pool *pool = worker->pool;
+    for (;;) {
+        int job = pop(&pool->deques[worker->self]);
+        for (int i = 1; job < 0 && i < pool->workers; i++) {
+            job = steal(&pool->deques[(worker->self + i) % pool->workers]);
+        }
+        if (job < 0) {
+            release_thread_cache();
+            return NULL;
+        }
+        run_job(&pool->jobs[job], pool->engine, pool->maxMem);
+    }
+}
+
+int run_batch(const char *manifest, const char *engine, int workers,
+              size_t maxMem)
+{
+    FILE *fp = fopen(manifest, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "um: cannot open %s: %s\n", manifest,
+                strerror(errno));
+        return -1;
+    }
+    int count = 0;
+    Job *jobs = read_manifest(fp, manifest, &count);
+    fclose(fp);
+    if (jobs == NULL) {
+        return -1;
+    }
+    if (workers < 1) {
+        workers = 1;
+    }
+    if (workers > count && count > 0) {
+        workers = count;
+    }
+
+    Pool pool = { jobs, calloc(workers, sizeof(Deque)), workers, engine,
+                  maxMem };
+    Worker *threads = calloc(workers, sizeof(*threads));
+    pthread_t *ids = calloc(workers, sizeof(*ids));
+    assert(pool.deques != NULL && threads != NULL && ids != NULL);
+    for (int w = 0; w < workers; w++) {
+        pthread_mutex_init(&pool.deques[w].lock, NULL);
+        pool.deques[w].jobs = malloc((count / workers + 1) * sizeof(int));
+        assert(pool.deques[w].jobs != NULL);
+    }
+    for (int j = 0; j < count; j++) {
+        Deque *deque = &pool.deques[j % workers];
+        deque->jobs[deque->tail++] = j;
+    }
+
+    double start = now();
+    for (int w = 0; w < workers; w++) {
+        threads[w].pool = &pool;
+        threads[w].self = w;
+        int failed = pthread_create(&ids[w], NULL, work, &threads[w]);
+        assert(failed == 0);
+    }
+    for (int w = 0; w < workers; w++) {
+        pthread_join(ids[w], NULL);
+    }
+    double wall = now() - start;
+
+    int failures = 0;
+    double busy = 0.0;
+    printf("job\tprogram\tseconds\tpeak_bytes\tstatus\n");
+    for (int j = 0; j < count; j++) {
+        printf("%d\t%s\t%.6f\t%zu\t%s\n", j + 1,
+               jobs[j].program ? jobs[j].program : "-", jobs[j].seconds,
+               jobs[j].peakBytes, jobs[j].status);
+        failures += strcmp(jobs[j].status, "ok") != 0;
+        busy += jobs[j].seconds;
+    }
+    printf("# %d jobs, %d failed, %d workers, %.3f s wall, %.3f s of jobs, "
+           "%.1f jobs/s, %.2fx parallel\n", count, failures, workers, wall,
+           busy, wall > 0 ? count / wall : 0.0, wall > 0 ? busy / wall : 0.0);
+
+    for (int w = 0; w < workers; w++) {
+        pthread_mutex_destroy(&pool.deques[w].lock);
+        free(pool.deques[w].jobs);
+    }
+    for (int j = 0; j < count; j++) {
+        free(jobs[j].program);
+        free(jobs[j].input);
+        free(jobs[j].output);
+    }
+    free(pool.deques);
+    free(threads);
+    free(ids);
+    free(jobs);
+    return failures;
+}
\ No newline at end of file
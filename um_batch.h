@@ -0,0 +1,25 @@
+/**
+ ** um_batch.h
+ ** Purpose: Interface for running a manifest of um programs on a pool of
+ ** threads
+ **/
+
+#ifndef UM_BATCH_H
+#define UM_BATCH_H
+
+#include <stddef.h>
+
+/* Takes in the name of a manifest, the engine to run with, the number of
+ * worker threads and the host bytes each job's machine may hold (0 for no
+ * limit, as with --max-mem). Each line of the manifest names a program,
+ * the file its input comes from and the file its output goes to ("-" for
+ * none); blank lines and lines starting with '#' are skipped. Function runs
+ * every job, each on its own machine, and prints the time each job took and
+ * the total throughput to stdout. A program that fails ends only its own job,
+ * which is reported as "failed: " and the failure. Returns the number of
+ * jobs that failed, or -1 if the manifest could not be read.
+ */
+int run_batch(const char *manifest, const char *engine, int workers,
+              size_t maxMem);
+
+#endif
\ No newline at end of file
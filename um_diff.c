@@ -0,0 +1,452 @@
+/**
+ ** um_diff.c
+ ** Purpose: Implementation of the differential runner. Both machines read
+ ** their input from one buffer holding all of stdin and write their output
+ ** into buffers of their own, so a run depends on nothing but the program
+ ** and can be repeated exactly when a difference has to be narrowed down to
+ ** one instruction. A um failure ends only the machine it happens on, and
+ ** is compared like the rest of its state.
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "um_diff.h"
+#include "um_operations.h"
+#include "um_threaded.h"
+#include "um_load.h"
+#include "um_disasm.h"
+
+typedef struct Input {
+    const uint8_t *bytes;
+    size_t size;
+} Input;
+
+typedef struct Machine {
+    umStorage *mem;
+    const char *filename;
+    const Input *input;
+    size_t inputNext;
+    uint8_t *output;
+    size_t outputSize;
+    size_t outputCapacity;
+    uint64_t executed;
+    bool halted;
+    const char *failure;            /* NULL unless the program failed */
+    char failureText[128];
+} Machine;
+
+static size_t read_input(void *context, uint8_t *buffer, size_t size)
+{
+    Machine *machine = context;
+    size_t left = machine->input->size - machine->inputNext;
+    if (size > left) {
+        size = left;
+    }
+    memcpy(buffer, machine->input->bytes + machine->inputNext, size);
+    machine->inputNext += size;
+    return size;
+}
+
+static void write_output(void *context, const uint8_t *bytes, size_t size)
+{
+    Machine *machine = context;
+    if (machine->outputSize + size > machine->outputCapacity) {
+        size_t capacity = machine->outputCapacity ? machine->outputCapacity
+                                                  : 4096;
+        while (machine->outputSize + size > capacity) {
+            capacity *= 2;
+        }
+        machine->output = realloc(machine->output, capacity);
+        assert(machine->output != NULL);
+        machine->outputCapacity = capacity;
+    }
+    memcpy(machine->output + machine->outputSize, bytes, size);
+    machine->outputSize += size;
+}
+
+/* Takes in a machine, a program and the shared input. Function sets the
+ * machine up to run the program from the start, or returns false if the
+ * program cannot be loaded.
+ */
+static bool start(Machine *machine, const char *filename, const Input *input)
+{
+    Segment *program = load_program(filename);
+    if (program == NULL) {
+        return false;
+    }
+    machine->mem = initialize_memory();
+    io_free(machine->mem->io);
+    machine->mem->io = io_new_callbacks(read_input, write_output, machine);
+    add_segment(program, machine->mem);
+    machine->filename = filename;
+    machine->input = input;
+    machine->inputNext = 0;
+    machine->outputSize = 0;
+    machine->executed = 0;
+    machine->halted = false;
+    machine->failure = NULL;
+    return true;
+}
+
+static void stop(Machine *machine)
+{
+    if (machine->mem != NULL) {
+        release_memory(machine->mem);
+        machine->mem = NULL;
+    }
+}
+
+/* keeps the failure a machine stopped with */
+static void note_failure(Machine *machine, const char *failure)
+{
+    snprintf(machine->failureText, sizeof(machine->failureText), "%s",
+             failure);
+    machine->failure = machine->failureText;
+}
+
+/* runs the reference machine for up to count instructions. The failing
+ * instruction is not counted as executed.
+ */
+static void step_reference(Machine *machine, uint64_t count)
+{
+    if (machine->halted || machine->failure != NULL) {
+        return;
+    }
+    umRecovery recovery;
+    umRecovery *outer = um_recovery;
+    um_recovery = &recovery;
+    if (setjmp(recovery.env) == 0) {
+        for (uint64_t i = 0; i < count && !machine->halted; i++) {
+            machine->halted = run_instruction(machine->mem);
+            machine->executed++;
+        }
+    } else {
+        note_failure(machine, recovery.failure);
+    }
+    um_recovery = outer;
+}
+
+/* runs the machine under check for up to count instructions. A failure
+ * loses the budget left with the engine, so the machine is run again to
+ * where the step began and then one instruction at a time, to count the
+ * instructions before the failing one as the reference does.
+ */
+static void step_threaded(Machine *machine, uint64_t count)
+{
+    if (machine->halted || machine->failure != NULL || count == 0) {
+        return;
+    }
+    uint64_t budget = count;
+    umRecovery recovery;
+    umRecovery *outer = um_recovery;
+    um_recovery = &recovery;
+    if (setjmp(recovery.env) == 0) {
+        machine->halted = run_threaded_budgeted(machine->mem, &budget);
+        machine->executed += count - budget;
+        um_recovery = outer;
+    } else if (count == 1) {
+        um_recovery = outer;
+        note_failure(machine, recovery.failure);
+    } else {
+        um_recovery = outer;
+        uint64_t done = machine->executed;
+        stop(machine);
+        if (!start(machine, machine->filename, machine->input)) {
+            exit(EXIT_FAILURE);
+        }
+        step_threaded(machine, done);
+        while (!machine->halted && machine->failure == NULL) {
+            step_threaded(machine, 1);
+        }
+    }
+}
+
+/* runs the machine under check to the end with the named engine */
+static void run_to_end(Machine *machine, const char *engine)
+{
+    umRecovery recovery;
+    umRecovery *outer = um_recovery;
+    um_recovery = &recovery;
+    if (setjmp(recovery.env) == 0) {
+        run_engine(machine->mem, engine);
+        machine->halted = true;
+    } else {
+        note_failure(machine, recovery.failure);
+    }
+    um_recovery = outer;
+}
+
+/* Takes in the two machines and a buffer for the first difference found.
+ * Function compares everything but the segments: whether the machines
+ * failed and how, whether they halted, the instructions they ran (when
+ * counted is true), the program counter, the registers and the output so
+ * far. A failing engine leaves no counter behind, and one not counted
+ * (the jit) no registers either, so those are not compared once both
+ * machines failed.
+ */
+static bool same_registers(Machine *ref, Machine *test, bool counted,
+                           char *why, size_t size)
+{
+    umStorage *a = ref->mem;
+    umStorage *b = test->mem;
+    io_flush(a->io);
+    io_flush(b->io);
+
+    if ((ref->failure == NULL) != (test->failure == NULL)) {
+        snprintf(why, size, "only the %s machine failed (%s)",
+                 ref->failure != NULL ? "reference" : "checked",
+                 ref->failure != NULL ? ref->failure : test->failure);
+        return false;
+    }
+    if (ref->failure != NULL && strcmp(ref->failure, test->failure) != 0) {
+        snprintf(why, size, "failed with \"%s\", the reference with \"%s\"",
+                 test->failure, ref->failure);
+        return false;
+    }
+    if (ref->halted != test->halted) {
+        snprintf(why, size, "only the %s machine halted",
+                 ref->halted ? "reference" : "checked");
+        return false;
+    }
+    if (counted && ref->executed != test->executed) {
+        snprintf(why, size, "ran %llu instructions, the reference %llu",
+                 (unsigned long long)test->executed,
+                 (unsigned long long)ref->executed);
+        return false;
+    }
+    if (ref->failure == NULL && a->counter != b->counter) {
+        snprintf(why, size, "program counter is %u, the reference %u",
+                 b->counter, a->counter);
+        return false;
+    }
+    for (int r = 0; r < 8 && (ref->failure == NULL || counted); r++) {
+        if (a->registers[r] != b->registers[r]) {
+            snprintf(why, size, "r%d is 0x%08x, the reference 0x%08x", r,
+                     b->registers[r], a->registers[r]);
+            return false;
+        }
+    }
+    size_t common = ref->outputSize < test->outputSize ? ref->outputSize
+                                                       : test->outputSize;
+    for (size_t i = 0; i < common; i++) {
+        if (ref->output[i] != test->output[i]) {
+            snprintf(why, size, "output byte %zu is %u, the reference %u", i,
+                     test->output[i], ref->output[i]);
+            return false;
+        }
+    }
+    if (ref->outputSize != test->outputSize) {
+        snprintf(why, size, "output is %zu bytes, the reference %zu",
+                 test->outputSize, ref->outputSize);
+        return false;
+    }
+    return true;
+}
+
+/* Takes in the two machines and a segment identifier. Function compares
+ * the segment in both and describes the first difference.
+ */
+static bool same_segment(Machine *ref, Machine *test, uint32_t id,
+                         char *why, size_t size)
+{
+    bool mapped = is_mapped(ref->mem, id);
+    if (mapped != is_mapped(test->mem, id)) {
+        snprintf(why, size, "segment %u is %s, in the reference %s", id,
+                 mapped ? "unmapped" : "mapped",
+                 mapped ? "mapped" : "unmapped");
+        return false;
+    }
+    if (!mapped) {
+        return true;
+    }
+    Segment *a = get_segment(ref->mem, id);
+    Segment *b = get_segment(test->mem, id);
+    if (a->length != b->length) {
+        snprintf(why, size, "segment %u has %u words, in the reference %u",
+                 id, b->length, a->length);
+        return false;
+    }
+    if (a == b || memcmp(a->words, b->words,
+                         a->length * sizeof(uint32_t)) == 0) {
+        return true;
+    }
+    for (uint32_t i = 0; i < a->length; i++) {
+        if (a->words[i] != b->words[i]) {
+            snprintf(why, size, "segment %u word %u is 0x%08x, in the "
+                     "reference 0x%08x", id, i, b->words[i], a->words[i]);
+            break;
+        }
+    }
+    return false;
+}
+
+/* compares the whole state of the two machines */
+static bool same_state(Machine *ref, Machine *test, bool counted, char *why,
+                       size_t size)
+{
+    if (!same_registers(ref, test, counted, why, size)) {
+        return false;
+    }
+    if (ref->failure != NULL && !counted) {
+        return true;
+    }
+    if (ref->mem->segmentCount != test->mem->segmentCount) {
+        snprintf(why, size, "segment table has %u entries, the reference %u",
+                 test->mem->segmentCount, ref->mem->segmentCount);
+        return false;
+    }
+    for (uint32_t id = 0; id < ref->mem->segmentCount; id++) {
+        if (!same_segment(ref, test, id, why, size)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Takes in the two machines, the program and a number of instructions.
+ * Function runs both machines again from the start for that many
+ * instructions, each in one go, and returns true if their states differ.
+ * Running the checked engine in one go keeps every fused pair in the way
+ * whole, as it was when the difference was first seen.
+ */
+static bool differ_after(Machine *ref, Machine *test, const char *filename,
+                         const Input *input, uint64_t count, char *why,
+                         size_t size)
+{
+    stop(ref);
+    stop(test);
+    if (!start(ref, filename, input) || !start(test, filename, input)) {
+        exit(EXIT_FAILURE);
+    }
+    step_reference(ref, count);
+    step_threaded(test, count);
+    return !same_state(ref, test, true, why, size);
+}
+
+/* Takes in the two machines, the program, a number of instructions after
+ * which they agree and a larger one after which they differ. Function
+ * bisects between the two, running both machines again from the start for
+ * each guess, and reports the first instruction after which they differ.
+ */
+static void report_first_difference(Machine *ref, Machine *test,
+                                    const char *filename, const Input *input,
+                                    uint64_t agreed, uint64_t differed)
+{
+    char why[256];
+    while (differed - agreed > 1) {
+        uint64_t middle = agreed + (differed - agreed) / 2;
+        if (differ_after(ref, test, filename, input, middle, why,
+                         sizeof(why))) {
+            differed = middle;
+        } else {
+            agreed = middle;
+        }
+    }
+
+    differ_after(ref, test, filename, input, agreed, why, sizeof(why));
+    uint32_t pc = ref->mem->counter;
+    uint32_t program = ref->mem->programID;
+    uint32_t word = pc < ref->mem->programLength ? ref->mem->program[pc] : 0;
+    char text[64];
+    disassemble(word, text, sizeof(text));
+
+    differ_after(ref, test, filename, input, differed, why, sizeof(why));
+    fprintf(stderr, "um: threaded differs from loop after instruction %llu "
+                    "(program %u, pc %u: %s): %s\n",
+            (unsigned long long)differed, program, pc, text, why);
+}
+
+int run_diff(const char *filename, const char *engine, uint64_t interval)
+{
+    bool lockstep = strcmp(engine, "threaded") == 0;
+    if (!lockstep && strcmp(engine, "jit") != 0
+        && strcmp(engine, "loop") != 0) {
+        fprintf(stderr, "um: unknown engine '%s'\n", engine);
+        return -1;
+    }
+    if (interval == 0) {
+        interval = 1;
+    }
+
+    Input input;
+    size_t size = 0;
+    uint8_t *bytes = read_all(STDIN_FILENO, &size);
+    if (bytes == NULL) {
+        fprintf(stderr, "um: cannot read the input\n");
+        return -1;
+    }
+    input.bytes = bytes;
+    input.size = size;
+
+    Machine ref, test;
+    memset(&ref, 0, sizeof(ref));
+    memset(&test, 0, sizeof(test));
+    if (!start(&ref, filename, &input) || !start(&test, filename, &input)) {
+        stop(&ref);
+        free(bytes);
+        return -1;
+    }
+
+    char why[256];
+    bool same = true;
+    if (!lockstep) {
+        step_reference(&ref, UINT64_MAX);
+        run_to_end(&test, engine);
+        same = same_state(&ref, &test, false, why, sizeof(why));
+        if (same && ref.failure != NULL) {
+            fprintf(stderr, "um: %s agrees with loop, both failing after "
+                            "%llu instructions with \"%s\"\n", engine,
+                    (unsigned long long)ref.executed, ref.failure);
+        } else if (same) {
+            fprintf(stderr, "um: %s agrees with loop at halt, after %llu "
+                            "instructions\n", engine,
+                    (unsigned long long)ref.executed);
+        } else {
+            fprintf(stderr, "um: %s differs from loop at halt: %s\n", engine,
+                    why);
+        }
+    } else {
+        uint64_t agreed = 0;
+        uint64_t checks = 0;
+        while (same && !ref.halted && ref.failure == NULL) {
+            step_reference(&ref, interval);
+            step_threaded(&test, interval);
+            checks++;
+            same = same_state(&ref, &test, true, why, sizeof(why));
+            if (same) {
+                agreed = ref.executed;
+            }
+        }
+        if (same && ref.failure != NULL) {
+            fprintf(stderr, "um: threaded agrees with loop over %llu "
+                            "instructions (%llu comparisons), both failing "
+                            "with \"%s\"\n", (unsigned long long)ref.executed,
+                    (unsigned long long)checks, ref.failure);
+        } else if (same) {
+            fprintf(stderr, "um: threaded agrees with loop over %llu "
+                            "instructions (%llu comparisons)\n",
+                    (unsigned long long)ref.executed,
+                    (unsigned long long)checks);
+        } else {
+            /* a failing instruction is not counted, so a difference in
+             * failing shows one instruction past the last one counted
+             */
+            uint64_t differed = ref.executed;
+            if (ref.failure != NULL || test.failure != NULL) {
+                differed = (ref.executed > test.executed ? ref.executed
+                                                         : test.executed) + 1;
+            }
+            report_first_difference(&ref, &test, filename, &input, agreed,
+                                    differed);
+        }
+    }
+
+    stop(&ref);
+    stop(&test);
+    free(ref.output);
+    free(test.output);
+    free(bytes);
+    return same ? 0 : 1;
+}
\ No newline at end of file
@@ -0,0 +1,29 @@
+/**
+ ** um_diff.h
+ ** Purpose: Interface for the differential runner, which checks an engine
+ ** against the loop engine on the same program and input
+ **/
+
+#include <stdint.h>
+
+#ifndef UM_DIFF_H
+#define UM_DIFF_H
+
+/* Takes in the name of a program, the engine to check and the number of
+ * instructions between comparisons. Function reads all of stdin, then runs
+ * the program on two machines fed the same input: one on the loop engine,
+ * which is the reference, and one on the engine under check. The threaded
+ * engine is run in lockstep with the reference, interval instructions at a
+ * time, and the registers, program counter, output and every segment are
+ * compared after each step; once they differ, the step is bisected, running
+ * both machines again from the start for each guess, to find the first
+ * instruction after which they differ. Other engines
+ * cannot stop part way, so only their final state is compared. A um
+ * failure stops the machine it happens on and is compared with the rest of
+ * the state, so both machines failing the same way is agreement. Function
+ * prints the result to stderr and returns 0 if the machines agree, 1 if
+ * they differ and -1 if the program, input or engine cannot be used.
+ */
+int run_diff(const char *filename, const char *engine, uint64_t interval);
+
+#endif
\ No newline at end of file
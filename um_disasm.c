@@ -0,0 +1,65 @@
+/**
+ ** um_disasm.c
+ ** Purpose: Implementation of the instruction disassembler shared by the
+ ** profiler and umdump
+ **/
+
+#include <stdio.h>
+#include "um_disasm.h"
+
+void disassemble(uint32_t word, char *buffer, size_t size)
+{
+    unsigned op = word >> 28;
+    unsigned a = (word >> 6) & 7;
+    unsigned b = (word >> 3) & 7;
+    unsigned c = word & 7;
+
+    switch (op) {
+    case 0:
+        snprintf(buffer, size, "cmove r%u, r%u, r%u", a, b, c);
+        break;
+    case 1:
+        snprintf(buffer, size, "segload r%u, r%u, r%u", a, b, c);
+        break;
+    case 2:
+        snprintf(buffer, size, "segstore r%u, r%u, r%u", a, b, c);
+        break;
+    case 3:
+        snprintf(buffer, size, "add r%u, r%u, r%u", a, b, c);
+        break;
+    case 4:
+        snprintf(buffer, size, "multiply r%u, r%u, r%u", a, b, c);
+        break;
+    case 5:
+        snprintf(buffer, size, "divide r%u, r%u, r%u", a, b, c);
+        break;
+    case 6:
+        snprintf(buffer, size, "nand r%u, r%u, r%u", a, b, c);
+        break;
+    case 7:
+        snprintf(buffer, size, "halt");
+        break;
+    case 8:
+        snprintf(buffer, size, "map r%u, r%u", b, c);
+        break;
+    case 9:
+        snprintf(buffer, size, "unmap r%u", c);
+        break;
+    case 10:
+        snprintf(buffer, size, "output r%u", c);
+        break;
+    case 11:
+        snprintf(buffer, size, "input r%u", c);
+        break;
+    case 12:
+        snprintf(buffer, size, "loadprogram r%u, r%u", b, c);
+        break;
+    case 13:
+        snprintf(buffer, size, "loadval r%u, %u", (word >> 25) & 7,
+                 word & 0x1ffffff);
+        break;
+    default:
+        snprintf(buffer, size, ".word 0x%08x", word);
+        break;
+    }
+}
\ No newline at end of file
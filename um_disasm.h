@@ -0,0 +1,19 @@
+/**
+ ** um_disasm.h
+ ** Purpose: Interface for turning um instruction words into mnemonics
+ **/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef UM_DISASM_H
+#define UM_DISASM_H
+
+/* Takes in an instruction word and a buffer of the given size. Function
+ * writes the instruction as text, such as "add r3, r1, r2" or
+ * "loadval r1, 65", into the buffer. Words with an op code above 13 are
+ * written as data.
+ */
+void disassemble(uint32_t word, char *buffer, size_t size);
+
+#endif
\ No newline at end of file
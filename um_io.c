@@ -0,0 +1,311 @@
+/**
+ ** um_io.c
+ ** Purpose: Implementation of the buffered byte I/O. Output and input go
+ ** through large explicit buffers and plain read/write calls, so the um does
+ ** not pay for stdio locking and a library call on every byte. The buffers
+ ** are filled and drained through a pair of callbacks, which read and write
+ ** file descriptors unless an embedder supplies its own.
+ **
+ ** With a writer thread, full buffers go into a ring the thread drains
+ ** instead, so the um makes no system call for output unless the ring is
+ ** full or the output has to be drained, before input and at halt.
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include "assert.h"
+#include "um_io.h"
+
+/* reads from the input descriptor of the umIO passed as context */
+static size_t fd_read(void *context, uint8_t *buffer, size_t size)
+{
+    umIO *io = context;
+    for (;;) {
+        ssize_t got = read(io->inFd, buffer, size);
+        if (got >= 0) {
+            return (size_t)got;
+        }
+        if (errno != EINTR) {
+            return 0;
+        }
+    }
+}
+
+/* writes to the output descriptor of the umIO passed as context */
+static void fd_write(void *context, const uint8_t *bytes, size_t size)
+{
+    umIO *io = context;
+    size_t done = 0;
+    while (done < size) {
+        ssize_t wrote = write(io->outFd, bytes + done, size - done);
+        if (wrote < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            /* nothing can be shown anymore, so the output is dropped */
+            perror("um: write");
+            return;
+        }
+        done += (size_t)wrote;
+    }
+}
+
+/* The ring between the um and its writer thread. Only the um moves head
+ * and only the writer moves tail, so neither takes the lock while the ring
+ * is neither empty nor full. The lock and conditions are for sleeping: a
+ * side that finds the ring empty (the writer) or full (the um) sets its
+ * sleeping flag under the lock before checking again, and the other side
+ * only signals it when it sees that flag after moving its own index.
+ */
+struct umWriter {
+    umIO *io;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t added;           /* head moved, or stop was set */
+    pthread_cond_t written;         /* tail moved */
+    size_t head;                    /* buffers handed to the writer */
+    size_t tail;                    /* buffers written */
+    bool writerSleeping;
+    bool umSleeping;
+    bool stop;
+    size_t length[IO_RING_BLOCKS];
+    uint8_t ring[IO_RING_BLOCKS][IO_BUFFER_SIZE];
+};
+
+static size_t load_index(size_t *index)
+{
+    return __atomic_load_n(index, __ATOMIC_SEQ_CST);
+}
+
+static void store_index(size_t *index, size_t value)
+{
+    __atomic_store_n(index, value, __ATOMIC_SEQ_CST);
+}
+
+static bool load_flag(bool *flag)
+{
+    return __atomic_load_n(flag, __ATOMIC_SEQ_CST);
+}
+
+static void store_flag(bool *flag, bool value)
+{
+    __atomic_store_n(flag, value, __ATOMIC_SEQ_CST);
+}
+
+/* wakes the side sleeping on cond if its flag is set */
+static void wake(struct umWriter *writer, bool *sleeping,
+                 pthread_cond_t *cond)
+{
+    if (load_flag(sleeping)) {
+        pthread_mutex_lock(&writer->lock);
+        pthread_cond_signal(cond);
+        pthread_mutex_unlock(&writer->lock);
+    }
+}
+
+/* Takes in the ring of a umIO. Function writes the buffers handed to it,
+ * as many at a time as lie one after another in the ring, until it is
+ * stopped with the ring empty.
+ */
+static void *write_ring(void *arg)
+{
+    struct umWriter *writer = arg;
+    umIO *io = writer->io;
+    size_t tail = 0;
+    for (;;) {
+        size_t head = load_index(&writer->head);
+        if (head == tail) {
+            pthread_mutex_lock(&writer->lock);
+            store_flag(&writer->writerSleeping, true);
+            while ((head = load_index(&writer->head)) == tail
+                   && !writer->stop) {
+                pthread_cond_wait(&writer->added, &writer->lock);
+            }
+            store_flag(&writer->writerSleeping, false);
+            pthread_mutex_unlock(&writer->lock);
+            if (head == tail) {
+                return NULL;
+            }
+        }
+
+        /* only the last buffer handed over can be partly filled */
+        size_t first = tail % IO_RING_BLOCKS;
+        size_t count = 1;
+        size_t bytes = writer->length[first];
+        while (tail + count != head && first + count < IO_RING_BLOCKS
+               && writer->length[first + count - 1] == IO_BUFFER_SIZE) {
+            bytes += writer->length[first + count];
+            count++;
+        }
+        io->write(io->context, writer->ring[first], bytes);
+        tail += count;
+        store_index(&writer->tail, tail);
+        wake(writer, &writer->umSleeping, &writer->written);
+    }
+}
+
+/* Takes in the ring of a umIO and a number of buffers. Function waits until
+ * the writer has written that many.
+ */
+static void wait_written(struct umWriter *writer, size_t count)
+{
+    if (load_index(&writer->tail) >= count) {
+        return;
+    }
+    pthread_mutex_lock(&writer->lock);
+    store_flag(&writer->umSleeping, true);
+    while (load_index(&writer->tail) < count) {
+        pthread_cond_wait(&writer->written, &writer->lock);
+    }
+    store_flag(&writer->umSleeping, false);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+/* Takes in a umIO with buffered output. Function writes the buffer, or
+ * hands it to the writer thread and moves on to the next buffer of the
+ * ring once the writer is done with it.
+ */
+static void flush_buffer(umIO *io)
+{
+    struct umWriter *writer = io->writer;
+    if (writer == NULL) {
+        io->write(io->context, io->out, io->outUsed);
+        io->outUsed = 0;
+        return;
+    }
+    size_t head = writer->head;
+    writer->length[head % IO_RING_BLOCKS] = io->outUsed;
+    store_index(&writer->head, head + 1);
+    wake(writer, &writer->writerSleeping, &writer->added);
+
+    head++;
+    if (head >= IO_RING_BLOCKS) {
+        wait_written(writer, head - IO_RING_BLOCKS + 1);
+    }
+    io->out = writer->ring[head % IO_RING_BLOCKS];
+    io->outUsed = 0;
+}
+
+umIO *io_new_callbacks(io_read_fn read, io_write_fn write, void *context)
+{
+    umIO *io = malloc(sizeof(*io));
+    assert(io != NULL);
+    io->read = read;
+    io->write = write;
+    io->context = context;
+    io->inFd = -1;
+    io->outFd = -1;
+    io->inAtEnd = false;
+    io->inNext = 0;
+    io->inUsed = 0;
+    io->outUsed = 0;
+    io->out = io->outBuffer;
+    io->writer = NULL;
+    return io;
+}
+
+umIO *io_new(int inFd, int outFd)
+{
+    umIO *io = io_new_callbacks(fd_read, fd_write, NULL);
+    io->context = io;
+    io->inFd = inFd;
+    io->outFd = outFd;
+    return io;
+}
+
+bool io_start_writer(umIO *io)
+{
+    assert(io->writer == NULL);
+    io_flush(io);
+    struct umWriter *writer = malloc(sizeof(*writer));
+    assert(writer != NULL);
+    writer->io = io;
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->added, NULL);
+    pthread_cond_init(&writer->written, NULL);
+    writer->head = 0;
+    writer->tail = 0;
+    writer->writerSleeping = false;
+    writer->umSleeping = false;
+    writer->stop = false;
+
+    /* signals such as the profiler's are left to the um's thread, but a
+     * write to a closed pipe still ends the um as it did without a writer
+     */
+    sigset_t all, old;
+    sigfillset(&all);
+    sigdelset(&all, SIGPIPE);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int failed = pthread_create(&writer->thread, NULL, write_ring, writer);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (failed) {
+        pthread_cond_destroy(&writer->written);
+        pthread_cond_destroy(&writer->added);
+        pthread_mutex_destroy(&writer->lock);
+        free(writer);
+        return false;
+    }
+    io->writer = writer;
+    io->out = writer->ring[0];
+    return true;
+}
+
+void io_free(umIO *io)
+{
+    if (io != NULL) {
+        io_flush(io);
+        struct umWriter *writer = io->writer;
+        if (writer != NULL) {
+            pthread_mutex_lock(&writer->lock);
+            writer->stop = true;
+            pthread_cond_signal(&writer->added);
+            pthread_mutex_unlock(&writer->lock);
+            pthread_join(writer->thread, NULL);
+            pthread_cond_destroy(&writer->written);
+            pthread_cond_destroy(&writer->added);
+            pthread_mutex_destroy(&writer->lock);
+            free(writer);
+        }
+        free(io);
+    }
+}
+
+void io_flush(umIO *io)
+{
+    if (io->outUsed > 0) {
+        flush_buffer(io);
+    }
+    if (io->writer != NULL) {
+        wait_written(io->writer, io->writer->head);
+    }
+}
+
+void io_put(umIO *io, uint8_t byte)
+{
+    if (io->outUsed == IO_BUFFER_SIZE) {
+        flush_buffer(io);
+    }
+    io->out[io->outUsed++] = byte;
+}
+
+uint32_t io_get(umIO *io)
+{
+    while (io->inNext == io->inUsed) {
+        if (io->inAtEnd) {
+            return UINT32_MAX;
+        }
+        io_flush(io);
+        size_t got = io->read(io->context, io->in, IO_BUFFER_SIZE);
+        if (got == 0) {
+            io->inAtEnd = true;
+            continue;
+        }
+        io->inNext = 0;
+        io->inUsed = got;
+    }
+    return io->in[io->inNext++];
+}
\ No newline at end of file
@@ -0,0 +1,90 @@
+/**
+ ** um_io.h
+ ** Purpose: Interface for the buffered byte I/O behind the output and input
+ ** instructions. Every machine has its own umIO, so machines running side by
+ ** side in one process do not share any I/O state. Output can be handed to
+ ** a writer thread of its own, so a slow reader of the output does not stop
+ ** the um.
+ **/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef UM_IO_H
+#define UM_IO_H
+
+#define IO_BUFFER_SIZE (1 << 16)
+
+/* buffers of output a writer thread can be behind by */
+#define IO_RING_BLOCKS 16
+
+/* Fill a buffer with up to size bytes of input and return how many were
+ * stored, 0 once input has ended. Write size bytes of output.
+ */
+typedef size_t (*io_read_fn)(void *context, uint8_t *buffer, size_t size);
+typedef void (*io_write_fn)(void *context, const uint8_t *bytes,
+                            size_t size);
+
+struct umWriter;
+
+typedef struct umIO {
+    io_read_fn read;
+    io_write_fn write;
+    void *context;
+    int inFd;
+    int outFd;
+    bool inAtEnd;
+    size_t inNext;
+    size_t inUsed;
+    size_t outUsed;
+    uint8_t *out;                   /* buffer output is put into */
+    struct umWriter *writer;        /* NULL when the um writes output */
+    uint8_t in[IO_BUFFER_SIZE];
+    uint8_t outBuffer[IO_BUFFER_SIZE];
+} umIO;
+
+/* Takes in the descriptors a machine reads input from and writes output to.
+ * Function returns a new umIO over them; the descriptors stay owned by the
+ * caller. It is a checked runtime error that memory is able to be allocated.
+ */
+umIO *io_new(int inFd, int outFd);
+
+/* Takes in the functions a machine reads input with and writes output
+ * with, and a context passed to both. Function returns a new umIO over
+ * them. It is a checked runtime error that memory is able to be allocated.
+ */
+umIO *io_new_callbacks(io_read_fn read, io_write_fn write, void *context);
+
+/* Takes in a umIO. Function starts a thread that writes its output from
+ * then on: full buffers go into a ring of IO_RING_BLOCKS of them, which
+ * the thread drains with one write call for as many as are ready, and the
+ * um only waits when the ring is full. Returns false, with output written
+ * as before, if the thread cannot be started.
+ */
+bool io_start_writer(umIO *io);
+
+/* Takes in a umIO, or NULL. Function flushes its output, stops its writer
+ * thread if it has one, and frees it.
+ */
+void io_free(umIO *io);
+
+/* Takes in a umIO and a byte. Function appends the byte to the output
+ * buffer, writing the buffer out once it is full.
+ */
+void io_put(umIO *io, uint8_t byte);
+
+/* Takes in a umIO. Function returns the next byte of input, or UINT32_MAX
+ * (all ones) once input is exhausted. Pending output is flushed before any
+ * read that could block, so prompts are visible before the um waits on
+ * them.
+ */
+uint32_t io_get(umIO *io);
+
+/* Takes in a umIO. Function writes any buffered output, and with a writer
+ * thread waits until all of it has been written. It is called at halt and
+ * when the um exits.
+ */
+void io_flush(umIO *io);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,648 @@
+/**
+ ** um_jit.c
+ ** Purpose: Implementation of the x86-64 just-in-time compiling engine.
+ ** Inside a translated block um registers r0-r7 live in host registers
+ ** r8d-r15d and the um memory pointer lives in rbx, while eax, ecx, edx,
+ ** esi and edi are scratch. Each block is called as a function taking the
+ ** um memory and returns the index of the next instruction to run: either
+ ** where the block ends or its closing loadProgram jumps to, or, flagged
+ ** with INTERPRET, an instruction it stopped before because it needs the
+ ** interpreter. When the next instruction starts a translated block the
+ ** block jumps straight into it instead of returning.
+ **/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "um_operations.h"
+#include "um_jit.h"
+#include "um_snapshot.h"
+
+#if defined(__x86_64__)
+
+#include <sys/mman.h>
+
+/* most instructions translated into one block */
+#define MAX_BLOCK 256
+/* upper bound on the bytes of code emitted for one instruction */
+#define MAX_INSTRUCTION_BYTES 256
+/* upper bound on the side exits of one instruction */
+#define MAX_INSTRUCTION_EXITS 4
+#define MAX_BLOCK_BYTES (MAX_BLOCK * MAX_INSTRUCTION_BYTES + 256)
+/* bytes of executable memory holding translated blocks */
+#define CODE_SIZE (16 << 20)
+
+/* host register numbers */
+enum { EAX = 0, ECX = 1, EDX = 2, EBX = 3, ESI = 6, EDI = 7 };
+#define HOST(r) (8 + (r))
+#define REG_OFFSET(r) ((int)offsetof(umStorage, registers) + 4 * (r))
+
+/* Blocks return the index of the next instruction, with this bit set when
+ * that instruction must be run by the interpreter.
+ */
+#define INTERPRET ((uint64_t)1 << 32)
+
+typedef uint64_t (*BlockFn)(umStorage *mem);
+
+/* range [start, end) of segment 0 translated into one block */
+typedef struct Block {
+    uint32_t start;
+    uint32_t end;
+} Block;
+
+typedef struct Jit {
+    uint8_t *code;
+    size_t used;
+    uint32_t length;        /* length of segment 0 the tables cover */
+    BlockFn *entry;         /* block starting at each index, or NULL */
+    uint16_t *covered;      /* number of blocks covering each index */
+    Block *blocks;
+    uint32_t blockCount;
+    uint32_t blockCapacity;
+    uint8_t bodyOffset;     /* bytes of the prologue of every block */
+} Jit;
+
+/* instructions a block stops before, to be run by run_instruction */
+static inline bool ends_block(uint32_t instruction)
+{
+    uint32_t opCode = instruction >> 28;
+    return opCode == 7 || opCode == 10 || opCode == 11 || opCode > 13;
+}
+
+/* side exits of the block being translated, each taken before the
+ * instruction at pc runs
+ */
+typedef struct Exits {
+    uint8_t *patch[MAX_BLOCK * MAX_INSTRUCTION_EXITS];
+    uint32_t pc[MAX_BLOCK * MAX_INSTRUCTION_EXITS];
+    int count;
+} Exits;
+
+static void add_exit(Exits *exits, uint8_t *patch, uint32_t pc)
+{
+    exits->patch[exits->count] = patch;
+    exits->pc[exits->count] = pc;
+    exits->count++;
+}
+
+/* Stores into a segment from translated code. Returns 1 without storing if
+ * the store overwrites translated code, so the block exits and the store
+ * runs in the interpreter, otherwise 0.
+ */
+static uint32_t jit_segstore(Jit *jit, umStorage *mem, uint32_t ra,
+                             uint32_t rb, uint32_t rc)
+{
+    if (ra == 0 && rb < jit->length && jit->covered[rb] != 0) {
+        return 1;
+    }
+    Segment *seg = get_writable_segment(mem, ra);
+    um_check(rb < seg->length, "segment store out of bounds");
+    seg->words[rb] = rc;
+    if (ra == 0) {
+        invalidate_instruction(mem, rb);
+    }
+    return 0;
+}
+
+/* Instruction encoding */
+
+static inline void emit8(uint8_t **out, uint8_t byte)
+{
+    *(*out)++ = byte;
+}
+
+static inline void emit32(uint8_t **out, uint32_t value)
+{
+    memcpy(*out, &value, sizeof(value));
+    *out += sizeof(value);
+}
+
+static inline void emit64(uint8_t **out, uint64_t value)
+{
+    memcpy(*out, &value, sizeof(value));
+    *out += sizeof(value);
+}
+
+static void emit_rex(uint8_t **out, int wide, int reg, int rm)
+{
+    uint8_t rex = 0x40 | (wide << 3) | ((reg >> 3) << 2) | (rm >> 3);
+    if (rex != 0x40) {
+        emit8(out, rex);
+    }
+}
+
+/* one or two byte op code */
+static void emit_opcode(uint8_t **out, int opCode)
+{
+    if (opCode > 0xff) {
+        emit8(out, opCode >> 8);
+    }
+    emit8(out, opCode & 0xff);
+}
+
+/* 32 bit op with register operands */
+static void emit_rr(uint8_t **out, int opCode, int reg, int rm)
+{
+    emit_rex(out, 0, reg, rm);
+    emit_opcode(out, opCode);
+    emit8(out, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* 32 bit (or 64 bit if wide) op between a register and [rbx + disp] */
+static void emit_rbx_wide(uint8_t **out, int wide, int opCode, int reg,
+                          int disp)
+{
+    assert(disp >= 0 && disp < 128);
+    emit_rex(out, wide, reg, EBX);
+    emit_opcode(out, opCode);
+    emit8(out, 0x40 | ((reg & 7) << 3) | EBX);
+    emit8(out, disp);
+}
+
+static void emit_rbx(uint8_t **out, int opCode, int reg, int disp)
+{
+    emit_rbx_wide(out, 0, opCode, reg, disp);
+}
+
+static void emit_mov(uint8_t **out, int dst, int src)
+{
+    emit_rr(out, 0x89, src, dst);
+}
+
+static void emit_mov_imm(uint8_t **out, int dst, uint32_t value)
+{
+    emit_rex(out, 0, 0, dst);
+    emit8(out, 0xb8 + (dst & 7));
+    emit32(out, value);
+}
+
+/* stores um registers first through last back into the um memory */
+static void emit_spill(uint8_t **out, int first, int last)
+{
+    for (int r = first; r <= last; r++) {
+        emit_rbx(out, 0x89, HOST(r), REG_OFFSET(r));
+    }
+}
+
+/* loads um registers first through last from the um memory */
+static void emit_reload(uint8_t **out, int first, int last)
+{
+    for (int r = first; r <= last; r++) {
+        emit_rbx(out, 0x8b, HOST(r), REG_OFFSET(r));
+    }
+}
+
+/* loads a 64 bit value into a host register below r8 */
+static void emit_mov_imm64(uint8_t **out, int dst, uint64_t value)
+{
+    emit8(out, 0x48);
+    emit8(out, 0xb8 + dst);
+    emit64(out, value);
+}
+
+/* calls fn with the um memory as its first argument */
+static void emit_call(uint8_t **out, uintptr_t fn)
+{
+    emit8(out, 0x48);           /* mov rdi, rbx */
+    emit8(out, 0x89);
+    emit8(out, 0xdf);
+    emit_mov_imm64(out, EAX, fn);
+    emit8(out, 0xff);           /* call rax */
+    emit8(out, 0xd0);
+}
+
+/* jumps if the host register is zero (or not zero), returns where the
+ * offset is patched
+ */
+static uint8_t *emit_jump_if(uint8_t **out, int reg, bool zero)
+{
+    emit_rr(out, 0x85, reg, reg);           /* test */
+    emit8(out, 0x0f);                       /* jz/jnz rel32 */
+    emit8(out, zero ? 0x84 : 0x85);
+    uint8_t *patch = *out;
+    emit32(out, 0);
+    return patch;
+}
+
+/* jumps on the condition code cc (0x3 below/carry clear is jae, 0x5 is
+ * jnz), returns where the offset is patched
+ */
+static uint8_t *emit_jcc(uint8_t **out, int cc)
+{
+    emit8(out, 0x0f);
+    emit8(out, 0x80 | cc);
+    uint8_t *patch = *out;
+    emit32(out, 0);
+    return patch;
+}
+
+/* Leaves in rax the segment mapped at the identifier in the um register r,
+ * adding side exits for an identifier that is not mapped.
+ */
+static void emit_find_segment(uint8_t **out, int r, Exits *exits,
+                              uint32_t pc)
+{
+    emit_mov(out, ESI, HOST(r));
+    emit_rbx(out, 0x3b, ESI, offsetof(umStorage, segmentCount));  /* cmp */
+    add_exit(exits, emit_jcc(out, 0x3), pc);
+    emit_rbx_wide(out, 1, 0x8b, EAX, offsetof(umStorage, segments));
+    emit8(out, 0x48);                       /* mov rax, [rax + rsi * 8] */
+    emit8(out, 0x8b);
+    emit8(out, 0x04);
+    emit8(out, 0xf0);
+    emit8(out, 0xa8);                       /* test al, 1 */
+    emit8(out, 0x01);
+    add_exit(exits, emit_jcc(out, 0x5), pc);
+}
+
+/* Adds a side exit unless the offset in the um register r is within the
+ * segment in rax, leaving the offset in edx.
+ */
+static void emit_check_offset(uint8_t **out, int r, Exits *exits,
+                              uint32_t pc)
+{
+    emit_mov(out, EDX, HOST(r));
+    emit8(out, 0x3b);                       /* cmp edx, [rax] */
+    emit8(out, 0x10);
+    add_exit(exits, emit_jcc(out, 0x3), pc);
+}
+
+/* mov between the um register r and [rax + rdx * 4 + words] */
+static void emit_word(uint8_t **out, int opCode, int r)
+{
+    emit_rex(out, 0, HOST(r), EAX);
+    emit8(out, opCode);
+    emit8(out, 0x44 | ((HOST(r) & 7) << 3));
+    emit8(out, 0x90);
+    emit8(out, offsetof(Segment, words));
+}
+
+/* jumps unconditionally, returns where the offset is patched */
+static uint8_t *emit_jump(uint8_t **out)
+{
+    emit8(out, 0xe9);
+    uint8_t *patch = *out;
+    emit32(out, 0);
+    return patch;
+}
+
+static void patch_jump(uint8_t *patch, uint8_t *target)
+{
+    int32_t offset = (int32_t)(target - (patch + 4));
+    memcpy(patch, &offset, sizeof(offset));
+}
+
+/* Emits the code for the instruction at pc, which does not end a block,
+ * adding side exits taken before it runs whenever it needs the interpreter
+ * (including every um failure, which the interpreter then reports). A
+ * loadProgram is the last instruction of its block; its jump is patched by
+ * the caller to the epilogue with the target in eax.
+ */
+static void translate_instruction(Jit *jit, uint8_t **out, Decoded *d,
+                                  uint32_t pc, Exits *exits, uint8_t **jump)
+{
+    int a = d->a;
+    int b = d->b;
+    int c = d->c;
+
+    switch (d->op) {
+    case 0:
+        emit_rr(out, 0x85, HOST(c), HOST(c));           /* test */
+        emit_rr(out, 0x0f45, HOST(a), HOST(b));         /* cmovne */
+        break;
+    case 1:
+        emit_find_segment(out, b, exits, pc);
+        emit_check_offset(out, c, exits, pc);
+        emit_word(out, 0x8b, a);
+        break;
+    case 2: {
+        uint8_t *toSegZero = emit_jump_if(out, HOST(a), true);
+        emit_find_segment(out, a, exits, pc);
+        emit8(out, 0x83);                       /* cmp dword [rax + 4], 1 */
+        emit8(out, 0x78);
+        emit8(out, offsetof(Segment, refs));
+        emit8(out, 0x01);
+        add_exit(exits, emit_jcc(out, 0x5), pc);  /* shared, copy first */
+        emit_check_offset(out, b, exits, pc);
+        emit_word(out, 0x89, c);
+        uint8_t *done = emit_jump(out);
+
+        /* jit_segstore(jit, mem, ra, rb, rc), r8d-r11d are caller saved
+         * and r8d is reloaded after
+         */
+        patch_jump(toSegZero, *out);
+        emit_spill(out, 0, 3);
+        emit_mov(out, EDX, HOST(a));
+        emit_mov(out, ECX, HOST(b));
+        emit_mov(out, HOST(0), HOST(c));
+        emit8(out, 0x48);                               /* mov rsi, rbx */
+        emit8(out, 0x89);
+        emit8(out, 0xde);
+        emit_mov_imm64(out, EDI, (uintptr_t)jit);
+        emit_mov_imm64(out, EAX, (uintptr_t)jit_segstore);
+        emit8(out, 0xff);                               /* call rax */
+        emit8(out, 0xd0);
+        emit_reload(out, 0, 3);
+        add_exit(exits, emit_jump_if(out, EAX, false), pc);
+        patch_jump(done, *out);
+        break;
+    }
+    case 3:
+        emit_mov(out, EAX, HOST(b));
+        emit_rr(out, 0x01, HOST(c), EAX);               /* add */
+        emit_mov(out, HOST(a), EAX);
+        break;
+    case 4:
+        emit_mov(out, EAX, HOST(b));
+        emit_rr(out, 0x0faf, EAX, HOST(c));             /* imul */
+        emit_mov(out, HOST(a), EAX);
+        break;
+    case 5:
+        /* division by zero is left to the interpreter */
+        add_exit(exits, emit_jump_if(out, HOST(c), true), pc);
+        emit_mov(out, EAX, HOST(b));
+        emit_rr(out, 0x31, EDX, EDX);                   /* xor */
+        emit_rr(out, 0xf7, 6, HOST(c));                 /* div */
+        emit_mov(out, HOST(a), EAX);
+        break;
+    case 6:
+        emit_mov(out, EAX, HOST(b));
+        emit_rr(out, 0x21, HOST(c), EAX);               /* and */
+        emit_rr(out, 0xf7, 2, EAX);                     /* not */
+        emit_mov(out, HOST(a), EAX);
+        break;
+    case 8:
+        emit_spill(out, 0, 7);
+        emit_mov_imm(out, ESI, b);
+        emit_mov_imm(out, EDX, c);
+        emit_call(out, (uintptr_t)mapSegment);
+        emit_reload(out, 0, 7);
+        break;
+    case 9:
+        emit_spill(out, 0, 7);
+        emit_mov_imm(out, ESI, c);
+        emit_call(out, (uintptr_t)unmapSegment);
+        emit_reload(out, 0, 7);
+        break;
+    case 12:
+        /* copying a segment into segment 0 runs in the interpreter, a jump
+         * within segment 0 returns the target
+         */
+        add_exit(exits, emit_jump_if(out, HOST(b), false), pc);
+        emit_mov(out, EAX, HOST(c));
+        *jump = emit_jump(out);
+        break;
+    case 13:
+        emit_mov_imm(out, HOST(a), d->value);
+        break;
+    default:
+        assert(0);
+    }
+}
+
+/* Emits a jump from the end of a block straight into the body of the block
+ * translated at the index in eax, skipping its prologue since the um
+ * registers are already in host registers. Falls back to the epilogue,
+ * through the three jumps returned in toEpilogue, when a snapshot has been
+ * requested, the index is past the end of segment 0 or nothing is
+ * translated there.
+ */
+static void emit_chain(Jit *jit, uint8_t **out, uint8_t *toEpilogue[3])
+{
+    emit_mov_imm64(out, EDX, (uintptr_t)&snapshot_requested);
+    emit8(out, 0x83);                       /* cmp dword [rdx], 0 */
+    emit8(out, 0x3a);
+    emit8(out, 0x00);
+    emit8(out, 0x0f);                       /* jne rel32 */
+    emit8(out, 0x85);
+    toEpilogue[2] = *out;
+    emit32(out, 0);
+    emit8(out, 0x3d);                       /* cmp eax, length */
+    emit32(out, jit->length);
+    emit8(out, 0x0f);                       /* jae rel32 */
+    emit8(out, 0x83);
+    toEpilogue[0] = *out;
+    emit32(out, 0);
+    emit_mov_imm64(out, EDX, (uintptr_t)jit->entry);
+    emit8(out, 0x48);                       /* mov rdx, [rdx + rax * 8] */
+    emit8(out, 0x8b);
+    emit8(out, 0x14);
+    emit8(out, 0xc2);
+    emit8(out, 0x48);                       /* test rdx, rdx */
+    emit8(out, 0x85);
+    emit8(out, 0xd2);
+    emit8(out, 0x0f);                       /* jz rel32 */
+    emit8(out, 0x84);
+    toEpilogue[1] = *out;
+    emit32(out, 0);
+    emit8(out, 0x48);                       /* add rdx, bodyOffset */
+    emit8(out, 0x83);
+    emit8(out, 0xc2);
+    emit8(out, jit->bodyOffset);
+    emit8(out, 0xff);                       /* jmp rdx */
+    emit8(out, 0xe2);
+}
+
+/* Block bookkeeping */
+
+/* drops every translation and sizes the tables for a segment 0 of length */
+static void jit_reset(Jit *jit, uint32_t length)
+{
+    free(jit->entry);
+    free(jit->covered);
+    jit->entry = calloc(length + 1, sizeof(*jit->entry));
+    jit->covered = calloc(length + 1, sizeof(*jit->covered));
+    assert(jit->entry != NULL && jit->covered != NULL);
+    jit->length = length;
+    jit->blockCount = 0;
+    jit->used = 0;
+}
+
+/* drops every block covering the word at index of segment 0 */
+static void jit_invalidate(Jit *jit, uint32_t index)
+{
+    if (index >= jit->length || jit->covered[index] == 0) {
+        return;
+    }
+    uint32_t i = 0;
+    while (i < jit->blockCount) {
+        Block *block = &jit->blocks[i];
+        if (block->start <= index && index < block->end) {
+            jit->entry[block->start] = NULL;
+            for (uint32_t k = block->start; k < block->end; k++) {
+                jit->covered[k]--;
+            }
+            jit->blocks[i] = jit->blocks[--jit->blockCount];
+        } else {
+            i++;
+        }
+    }
+}
+
+/* translates the run of segment 0 starting at start into a new block */
+static BlockFn translate(Jit *jit, umStorage *mem, uint32_t start)
+{
+    if (CODE_SIZE - jit->used < MAX_BLOCK_BYTES) {
+        jit_reset(jit, jit->length);
+    }
+
+    uint8_t *begin = jit->code + jit->used;
+    uint8_t *p = begin;
+    Exits exits;
+    exits.count = 0;
+
+    /* prologue: push rbx, r12-r15, then mov rbx, rdi */
+    emit8(&p, 0x53);
+    for (int r = 12; r <= 15; r++) {
+        emit8(&p, 0x41);
+        emit8(&p, 0x50 + (r & 7));
+    }
+    emit8(&p, 0x48);
+    emit8(&p, 0x89);
+    emit8(&p, 0xfb);
+    emit_reload(&p, 0, 7);
+    jit->bodyOffset = p - begin;
+
+    uint8_t *jump = NULL;
+    uint32_t pc = start;
+    while (jump == NULL && pc < mem->programLength &&
+           pc - start < MAX_BLOCK && !ends_block(mem->program[pc])) {
+        Decoded d;
+        decode_instruction(&d, mem->program[pc]);
+        translate_instruction(jit, &p, &d, pc, &exits, &jump);
+        pc++;
+    }
+
+    /* falls through to the instruction after the block */
+    emit_mov_imm(&p, EAX, pc);
+    if (jump != NULL) {
+        patch_jump(jump, p);
+    }
+    uint8_t *toEpilogue[3];
+    emit_chain(jit, &p, toEpilogue);
+
+    uint8_t *epilogue = p;
+    for (int i = 0; i < 3; i++) {
+        patch_jump(toEpilogue[i], epilogue);
+    }
+    emit_spill(&p, 0, 7);
+    for (int r = 15; r >= 12; r--) {
+        emit8(&p, 0x41);
+        emit8(&p, 0x58 + (r & 7));
+    }
+    emit8(&p, 0x5b);
+    emit8(&p, 0xc3);
+
+    /* side exits return the index of the instruction they stop before */
+    for (int i = 0; i < exits.count; i++) {
+        patch_jump(exits.patch[i], p);
+        emit_mov_imm64(&p, EAX, INTERPRET | exits.pc[i]);
+        patch_jump(emit_jump(&p), epilogue);
+    }
+
+    jit->used += ((p - begin) + 15) & ~(size_t)15;
+
+    if (jit->blockCount == jit->blockCapacity) {
+        jit->blockCapacity = jit->blockCapacity ? 2 * jit->blockCapacity : 64;
+        jit->blocks = realloc(jit->blocks,
+                              jit->blockCapacity * sizeof(*jit->blocks));
+        assert(jit->blocks != NULL);
+    }
+    jit->blocks[jit->blockCount].start = start;
+    jit->blocks[jit->blockCount].end = pc;
+    jit->blockCount++;
+    for (uint32_t k = start; k < pc; k++) {
+        jit->covered[k]++;
+    }
+
+    BlockFn block = (BlockFn)(uintptr_t)begin;
+    jit->entry[start] = block;
+    return block;
+}
+
+/* frees a jit and the code it translated */
+static void release_jit(Jit *jit)
+{
+    free(jit->entry);
+    free(jit->covered);
+    free(jit->blocks);
+    munmap(jit->code, CODE_SIZE);
+    free(jit);
+}
+
+void run_jit(umStorage *mem)
+{
+    Jit *jit = calloc(1, sizeof(*jit));
+    assert(jit != NULL);
+    jit->code = mmap(NULL, CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(jit->code != MAP_FAILED);
+    jit_reset(jit, mem->programLength);
+
+    /* a failure going back to the thread's recovery point frees the jit
+     * on the way
+     */
+    umRecovery recovery;
+    umRecovery *outer = um_recovery;
+    if (outer != NULL) {
+        if (setjmp(recovery.env) != 0) {
+            um_recovery = outer;
+            release_jit(jit);
+            um_fail(recovery.failure);
+        }
+        um_recovery = &recovery;
+    }
+
+    uint32_t pc = mem->counter;
+    for (;;) {
+        if (snapshot_requested) {
+            mem->counter = pc;
+            snapshot_take(mem);
+        }
+        if (pc < mem->programLength && !ends_block(mem->program[pc])) {
+            BlockFn block = jit->entry[pc];
+            if (block == NULL) {
+                block = translate(jit, mem, pc);
+            }
+            uint64_t next = block(mem);
+            pc = (uint32_t)next;
+            if ((next & INTERPRET) == 0) {
+                continue;
+            }
+        }
+        um_check(pc < mem->programLength,
+                 "program counter ran off the end of segment 0");
+
+        /* runs the instruction the block stopped before */
+        uint32_t instruction = mem->program[pc];
+        uint32_t opCode = instruction >> 28;
+        uint32_t ra = mem->registers[(instruction >> 6) & 7];
+        uint32_t rb = mem->registers[(instruction >> 3) & 7];
+        mem->counter = pc;
+        if (run_instruction(mem)) {
+            break;
+        }
+        if (opCode == 2 && ra == 0) {
+            jit_invalidate(jit, rb);
+        } else if (opCode == 12 && rb != 0) {
+            jit_reset(jit, mem->programLength);
+        }
+        pc = mem->counter;
+    }
+
+    um_recovery = outer;
+    release_jit(jit);
+}
+
+#else
+
+void run_jit(umStorage *mem)
+{
+    while (!run_instruction(mem)) {
+    }
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,24 @@
+/**
+ ** um_jit.h
+ ** Purpose: Interface for the x86-64 just-in-time compiling engine
+ **/
+
+#include <stdint.h>
+#include "um_mem.h"
+
+#ifndef UM_JIT_H
+#define UM_JIT_H
+
+/* Takes in a pointer to the um's memory with segment 0 loaded. Function
+ * executes the program until halt by translating straight-line runs of
+ * segment 0 into native code, which keeps the 8 um registers in host
+ * registers. A run ends before halt, input, output or an unknown op code,
+ * and that instruction is executed by run_instruction; a loadProgram ends
+ * the run after it, jumping straight to its target when segment 0 stays.
+ * Translations are dropped when the words they were made from are
+ * overwritten by segStore or replaced by loadProgram. On hosts other than
+ * x86-64 the program is run by run_instruction alone.
+ */
+void run_jit(umStorage *mem);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,185 @@
+/**
+ ** um_load.c
+ ** Purpose: Implementation of the program loader. Regular files are mapped
+ ** and converted straight into the words of segment 0, with no stdio
+ ** buffering and no per-byte calls. The big-endian to host conversion uses
+ ** a byte shuffle when the host has SSSE3 or AVX2, picked once at runtime.
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "um_load.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define UM_LOAD_X86 1
+#endif
+
+static void words_scalar(uint32_t *words, const unsigned char *bytes,
+                         size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        uint32_t word;
+        memcpy(&word, bytes + 4 * i, sizeof(word));
+        words[i] = __builtin_bswap32(word);
+    }
+}
+
+#ifdef UM_LOAD_X86
+/* reverses the bytes within each 32 bit lane */
+#define BSWAP_LANES 12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3
+
+__attribute__((target("ssse3")))
+static void words_ssse3(uint32_t *words, const unsigned char *bytes,
+                        size_t count)
+{
+    const __m128i swap = _mm_set_epi8(BSWAP_LANES);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(bytes + 4 * i));
+        _mm_storeu_si128((__m128i *)(words + i), _mm_shuffle_epi8(v, swap));
+    }
+    words_scalar(words + i, bytes + 4 * i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void words_avx2(uint32_t *words, const unsigned char *bytes,
+                       size_t count)
+{
+    const __m256i swap = _mm256_set_epi8(BSWAP_LANES, BSWAP_LANES);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(bytes + 4 * i));
+        _mm256_storeu_si256((__m256i *)(words + i),
+                            _mm256_shuffle_epi8(v, swap));
+    }
+    words_scalar(words + i, bytes + 4 * i, count - i);
+}
+#endif
+
+void words_from_bytes(uint32_t *words, const unsigned char *bytes,
+                      size_t count)
+{
+#ifdef UM_LOAD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        words_avx2(words, bytes, count);
+        return;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        words_ssse3(words, bytes, count);
+        return;
+    }
+#endif
+    words_scalar(words, bytes, count);
+}
+
+Segment *program_from_bytes(const unsigned char *bytes, size_t size)
+{
+    if (size % 4 != 0 || size / 4 > UINT32_MAX) {
+        return NULL;
+    }
+    Segment *segment = new_segment(size / 4);
+    words_from_bytes(segment->words, bytes, size / 4);
+    return segment;
+}
+
+unsigned char *read_all(int fd, size_t *size)
+{
+    size_t capacity = 1 << 16;
+    size_t used = 0;
+    unsigned char *buffer = malloc(capacity);
+    if (buffer == NULL) {
+        return NULL;
+    }
+    for (;;) {
+        if (used == capacity) {
+            capacity *= 2;
+            unsigned char *bigger = realloc(buffer, capacity);
+            if (bigger == NULL) {
+                free(buffer);
+                return NULL;
+            }
+            buffer = bigger;
+        }
+        ssize_t got = read(fd, buffer + used, capacity - used);
+        if (got == 0) {
+            break;
+        }
+        if (got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            free(buffer);
+            return NULL;
+        }
+        used += (size_t)got;
+    }
+    *size = used;
+    return buffer;
+}
+
+Segment *load_program(const char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        fprintf(stderr, "um: cannot open %s: %s\n", filename,
+                strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    unsigned char *bytes = NULL;
+    size_t size = 0;
+    bool mapped = false;
+    if (S_ISREG(info.st_mode)) {
+        size = (size_t)info.st_size;
+        if (size > 0) {
+            bytes = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (bytes == MAP_FAILED) {
+                bytes = NULL;
+            } else {
+                madvise(bytes, size, MADV_SEQUENTIAL);
+                mapped = true;
+            }
+        }
+    }
+    if (!mapped && (size > 0 || !S_ISREG(info.st_mode))) {
+        bytes = read_all(fd, &size);
+        if (bytes == NULL) {
+            fprintf(stderr, "um: cannot read %s: %s\n", filename,
+                    strerror(errno));
+            close(fd);
+            return NULL;
+        }
+    }
+    close(fd);
+
+    Segment *program = NULL;
+    if (size % 4 != 0) {
+        fprintf(stderr, "um: %s is %zu bytes long, which is not a whole "
+                        "number of 32-bit words\n", filename, size);
+    } else {
+        program = program_from_bytes(bytes, size);
+        if (program == NULL) {
+            fprintf(stderr, "um: %s is %zu bytes long, more than a segment "
+                            "can hold\n", filename, size);
+        }
+    }
+
+    if (mapped) {
+        munmap(bytes, size);
+    } else {
+        free(bytes);
+    }
+    return program;
+}
\ No newline at end of file
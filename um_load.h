@@ -0,0 +1,40 @@
+/**
+ ** um_load.h
+ ** Purpose: Interface for loading um program images into segment 0
+ **/
+
+#include <stddef.h>
+#include <stdint.h>
+#include "um_mem.h"
+
+#ifndef UM_LOAD_H
+#define UM_LOAD_H
+
+/* Takes in a pointer to count words and a buffer of 4 * count bytes holding
+ * big-endian words. Function stores the words in host order. The buffer and
+ * the words may not overlap.
+ */
+void words_from_bytes(uint32_t *words, const unsigned char *bytes,
+                      size_t count);
+
+/* Takes in a buffer holding a program image and its size in bytes. Function
+ * returns a new segment holding the program, or NULL if the size is not a
+ * whole number of words or is more words than a segment can hold.
+ */
+Segment *program_from_bytes(const unsigned char *bytes, size_t size);
+
+/* Takes in a descriptor and a pointer to a size. Function reads everything
+ * left on the descriptor into a new buffer, for input that cannot be mapped,
+ * and stores its size. Returns NULL if reading fails.
+ */
+unsigned char *read_all(int fd, size_t *size);
+
+/* Takes in the name of a program file. Function maps the file (or reads it
+ * in bulk when it is a pipe or other stream) and returns a new segment
+ * holding the program. A file that cannot be read, or whose size is not a
+ * multiple of 4 or too large for a segment, is reported on stderr and NULL
+ * is returned.
+ */
+Segment *load_program(const char *filename);
+
+#endif
\ No newline at end of file
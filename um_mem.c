@@ -9,139 +9,441 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "um_mem.h"
 
-struct umStorage {
-    Seq_T registers;
-    Seq_T memory;
-    Seq_T unmappedID;
-    int counter;
-}; 
+__thread umRecovery *um_recovery = NULL;
+
+void um_fail(const char *failure)
+{
+    if (um_recovery != NULL) {
+        um_recovery->failure = failure;
+        longjmp(um_recovery->env, 1);
+    }
+    fprintf(stderr, "um: %s\n", failure);
+    exit(EXIT_FAILURE);
+}
+
+/* Takes in the um memory after a change to its usage. Function raises the
+ * peaks and fails the program if its host bytes are now past the limit.
+ */
+static void note_usage(umStorage *mem)
+{
+    umUsage *usage = &mem->usage;
+    if (usage->segments > usage->peakSegments) {
+        usage->peakSegments = usage->segments;
+    }
+    if (usage->words > usage->peakWords) {
+        usage->peakWords = usage->words;
+    }
+    if (usage->bytes > usage->peakBytes) {
+        usage->peakBytes = usage->bytes;
+    }
+    if (usage->limit != 0 && usage->bytes > usage->limit) {
+        static __thread char failure[128];
+        snprintf(failure, sizeof(failure), "memory limit of %zu bytes "
+                 "exceeded (%zu bytes in use)", usage->limit, usage->bytes);
+        um_fail(failure);
+    }
+}
+
+/* Takes in two consecutive instruction words. Function returns the fused
+ * op code for the pair, or the op code of the first word if the pair is not
+ * one of the idioms the threaded engine runs with a single dispatch.
+ */
+static uint8_t pair_op(uint32_t first, uint32_t second)
+{
+    uint32_t op = first >> 28;
+    uint32_t next = second >> 28;
+    if (op == 13 && next == 3) {
+        return UM_FUSED_LOADVAL_ADD;
+    } else if (op == 13 && next == 1) {
+        return UM_FUSED_LOADVAL_SEGLOAD;
+    } else if (op == 13 && next == 12) {
+        return UM_FUSED_LOADVAL_JUMP;
+    } else if (op == 6 && next == 6) {
+        return UM_FUSED_NAND_NAND;
+    } else if (op == 0 && next == 12) {
+        return UM_FUSED_CMOVE_JUMP;
+    }
+    return op;
+}
+
+/* Points the cached segment 0 fields at the segment now mapped at 0, and
+ * builds its decoded instruction array. Every word is decoded, then each
+ * record that starts a fusable pair gets the fused op code; its operand
+ * fields stay those of its own instruction, and the second instruction of
+ * the pair keeps a plain record of its own, so a jump into the middle of a
+ * pair runs correctly.
+ */
+static void set_seg_zero(umStorage *mem, Segment *seg)
+{
+    size_t bytes = (seg->length + 1) * sizeof(Decoded);
+    Decoded *decoded = malloc(bytes);
+    assert(decoded != NULL);
+
+    for (uint32_t i = 0; i < seg->length; i++) {
+        decode_instruction(&decoded[i], seg->words[i]);
+    }
+    for (uint32_t i = 0; i + 1 < seg->length; i++) {
+        decoded[i].op = pair_op(seg->words[i], seg->words[i + 1]);
+    }
+    /* one record past the end catches running off segment 0 */
+    decoded[seg->length].op = UM_PAST_END;
+
+    free(mem->decoded);
+    mem->decoded = decoded;
+    mem->program = seg->words;
+    mem->programLength = seg->length;
+
+    mem->usage.bytes += bytes - mem->usage.decodedBytes;
+    mem->usage.decodedBytes = bytes;
+    note_usage(mem);
+}
 
 umStorage* initialize_memory()
 {
-    umStorage *mem = malloc(sizeof(*mem));
-    assert(mem != NULL);
+    umStorage *mem = NULL;
+    int failed = posix_memalign((void **)&mem, 64, sizeof(*mem));
+    assert(failed == 0 && mem != NULL);
 
-    mem->registers = Seq_new(8);
     for (int i = 0; i < 8; i++) {
-        uint32_t *value = malloc(sizeof(*value));
-        assert(value != NULL);
-        *value = 0;
-        Seq_addhi(mem->registers, value);
-    }
-     
-    mem->memory = Seq_new(0);
-    mem->unmappedID = Seq_new(0);
+        mem->registers[i] = 0;
+    }
     mem->counter = 0;
+    mem->executing = 0;
+    mem->program = NULL;
+    mem->programLength = 0;
+    mem->decoded = NULL;
+
+    mem->segmentCapacity = 64;
+    mem->segments = malloc(mem->segmentCapacity * sizeof(*mem->segments));
+    assert(mem->segments != NULL);
+    mem->segmentCount = 0;
+    mem->freeID = NO_ID;
+    mem->programID = 0;
+    mem->mapping = NULL;
+    mem->mappingSize = 0;
+    mem->io = io_new(STDIN_FILENO, STDOUT_FILENO);
+    mem->trace = NULL;
+
+    memset(&mem->usage, 0, sizeof(mem->usage));
+    mem->usage.bytes = mem->segmentCapacity * sizeof(*mem->segments);
+    note_usage(mem);
 
     return mem;
 }
 
 void release_memory(umStorage *mem)
 {
-    int length = Seq_length(mem->memory);
-    /* free every sequence in memory pool */
-    Seq_T temp;
-    for (int i = 0; i < length; i++) {
-        temp = Seq_get(mem->memory, i);
-        if (temp == NULL) { 
-            continue;
+    io_free(mem->io);
+
+    /* free every segment in the segment table */
+    for (uint32_t i = 0; i < mem->segmentCount; i++) {
+        if (is_mapped(mem, i)) {
+            free_segment(mem->segments[i].segment);
+        }
+    }
+    free(mem->segments);
+    if (mem->mapping != NULL) {
+        munmap(mem->mapping, mem->mappingSize);
+    }
+
+    free(mem->decoded);
+    free(mem);
+}
+
+/* Segments of at least this many words get an anonymous mapping of their
+ * own. The kernel fills in zero pages only as they are first touched, so
+ * mapping a huge segment costs nothing up front, and unmapping it returns
+ * the memory at once.
+ */
+#define LARGE_WORDS (1u << 16)
+
+/* large mappings of at least this many bytes are offered huge pages */
+#define HUGE_PAGE_BYTES ((size_t)2 << 20)
+
+/* Segments of up to SMALL_WORDS words are rounded up to a power of two and
+ * kept, once freed, on a list per size class for the thread to reuse (at
+ * most CACHED_BLOCKS per class), so programs that map and unmap small
+ * segments in a loop rarely reach malloc. Each machine runs on one thread
+ * at a time, so the lists need no locking.
+ */
+#define SMALL_CLASSES 11
+#define SMALL_WORDS (1u << (SMALL_CLASSES - 1))
+#define CACHED_BLOCKS 256
+
+typedef struct FreeBlock {
+    struct FreeBlock *next;
+} FreeBlock;
+
+static __thread FreeBlock *freeBlocks[SMALL_CLASSES];
+static __thread uint32_t freeCounts[SMALL_CLASSES];
+
+static int size_class(uint32_t length)
+{
+    return length <= 1 ? 0 : 32 - __builtin_clz(length - 1);
+}
+
+static size_t segment_bytes(uint32_t length)
+{
+    return sizeof(Segment) + (size_t)length * sizeof(uint32_t);
+}
+
+Segment *new_segment(uint32_t length)
+{
+    Segment *seg = NULL;
+    uint32_t flags = 0;
+
+    if (length >= LARGE_WORDS) {
+        size_t bytes = segment_bytes(length);
+        seg = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        assert(seg != MAP_FAILED);
+#ifdef MADV_HUGEPAGE
+        if (bytes >= HUGE_PAGE_BYTES) {
+            madvise(seg, bytes, MADV_HUGEPAGE);
         }
-        int tempSize = Seq_length(temp);
-        /* free every word in every sequence */
-        for (int j = 0; j < tempSize; j++) {
-            free(Seq_get(temp, j));
+#endif
+        flags = SEGMENT_LARGE;
+    } else if (length <= SMALL_WORDS) {
+        int class = size_class(length);
+        if (freeBlocks[class] != NULL) {
+            seg = (Segment *)freeBlocks[class];
+            freeBlocks[class] = freeBlocks[class]->next;
+            freeCounts[class]--;
+        } else {
+            seg = malloc(segment_bytes(1u << class));
+            assert(seg != NULL);
         }
-        Seq_free(&temp);
+        memset(seg->words, 0, (size_t)length * sizeof(uint32_t));
+        flags = SEGMENT_SMALL;
+    } else {
+        seg = calloc(1, segment_bytes(length));
+        assert(seg != NULL);
     }
-    Seq_free(&(mem->memory));
+    seg->length = length;
+    seg->refs = 1;
+    seg->flags = flags;
 
-    /* free every value in the registers */
-    for (int i = 0; i < 8; i++) {
-        free(Seq_get(mem->registers, i));
+    return seg;
+}
+
+void free_segment(Segment *seg)
+{
+    if (seg == NULL || --seg->refs != 0 || (seg->flags & SEGMENT_BORROWED)) {
+        return;
+    }
+    if (seg->flags & SEGMENT_LARGE) {
+        munmap(seg, segment_bytes(seg->length));
+    } else if (seg->flags & SEGMENT_SMALL) {
+        int class = size_class(seg->length);
+        if (freeCounts[class] < CACHED_BLOCKS) {
+            FreeBlock *block = (FreeBlock *)seg;
+            block->next = freeBlocks[class];
+            freeBlocks[class] = block;
+            freeCounts[class]++;
+        } else {
+            free(seg);
+        }
+    } else {
+        free(seg);
+    }
+}
+
+void release_thread_cache(void)
+{
+    for (int class = 0; class < SMALL_CLASSES; class++) {
+        while (freeBlocks[class] != NULL) {
+            FreeBlock *block = freeBlocks[class];
+            freeBlocks[class] = block->next;
+            free(block);
+        }
+        freeCounts[class] = 0;
     }
-    Seq_free(&(mem->registers));
+}
 
-    int unmappedSize = Seq_length(mem->unmappedID);
-   // fprintf(stderr, "size = %d\n")
-    for (int i = 0; i < unmappedSize; i++) {
-        free(Seq_get(mem->unmappedID, i));
+/* returns the host bytes a segment occupies, none for a borrowed one */
+static size_t host_bytes(const Segment *seg)
+{
+    if (seg->flags & SEGMENT_BORROWED) {
+        return 0;
+    } else if (seg->flags & SEGMENT_SMALL) {
+        return segment_bytes(1u << size_class(seg->length));
+    } else if (seg->flags & SEGMENT_LARGE) {
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        return (segment_bytes(seg->length) + page - 1) / page * page;
     }
-    Seq_free(&(mem->unmappedID));
+    return segment_bytes(seg->length);
+}
 
-    free(mem);
+/* Counts a segment just mapped at one more identifier. Its host bytes are
+ * counted when it is mapped for the first time.
+ */
+static void count_mapped(umStorage *mem, Segment *seg)
+{
+    mem->usage.segments++;
+    mem->usage.words += seg->length;
+    if (seg->refs == 1) {
+        mem->usage.bytes += host_bytes(seg);
+    }
+    note_usage(mem);
+}
+
+/* Counts a segment about to be unmapped from one identifier. Its host bytes
+ * go when the last identifier mapping it does.
+ */
+static void count_unmapped(umStorage *mem, Segment *seg)
+{
+    mem->usage.segments--;
+    mem->usage.words -= seg->length;
+    if (seg->refs == 1) {
+        mem->usage.bytes -= host_bytes(seg);
+    }
+}
+
+Segment *share_segment(Segment *seg)
+{
+    seg->refs++;
+    return seg;
 }
 
-uint32_t add_segment(Seq_T words, umStorage *mem)
+uint32_t add_segment(Segment *words, umStorage *mem)
 {
     uint32_t identifier = 0;
 
-    /* checks if unmapped segments can be remapped */
-    if (Seq_length(mem->unmappedID) > 0) {
-        uint32_t *id = (uint32_t*)Seq_remhi(mem->unmappedID);
-        Seq_put(mem->memory, *id, words);
-        identifier = *id;
-        free(id);
-    }       
-    /* maps segment to the end of main memory */
+    /* reuses the most recently unmapped identifier */
+    if (mem->freeID != NO_ID) {
+        identifier = mem->freeID;
+        mem->freeID = mem->segments[identifier].nextFree >> 1;
+    }
+    /* maps segment to the end of the segment table */
     else {
-        long length = Seq_length(mem->memory);
-        assert(length < 4294967296);
-        identifier = (uint32_t)length;
-        Seq_addhi(mem->memory, words);
+        assert(mem->segmentCount < NO_ID);
+        if (mem->segmentCount == mem->segmentCapacity) {
+            mem->usage.bytes += mem->segmentCapacity * sizeof(*mem->segments);
+            mem->segmentCapacity *= 2;
+            mem->segments = realloc(mem->segments, mem->segmentCapacity *
+                                                   sizeof(*mem->segments));
+            assert(mem->segments != NULL);
+        }
+        identifier = mem->segmentCount++;
+    }
+    mem->segments[identifier].segment = words;
+    count_mapped(mem, words);
+
+    if (identifier == 0) {
+        set_seg_zero(mem, words);
     }
 
     return identifier;
 }
 
-void remove_segment(umStorage *mem, uint32_t *identifier)
+void attach_seg_zero(umStorage *mem)
 {
-    Seq_addlo(mem->unmappedID, identifier);
-
-    Seq_T unmapped = Seq_get(mem->memory, *identifier);
-    int unmappedSize = Seq_length(unmapped);
+    set_seg_zero(mem, get_segment(mem, 0));
+}
 
-    for (int i = 0; i < unmappedSize; i++) {
-        free(Seq_get(unmapped, i));
+void recount_usage(umStorage *mem)
+{
+    umUsage *usage = &mem->usage;
+    usage->segments = 0;
+    usage->words = 0;
+    /* restored segments are borrowed, their bytes are in the mapping */
+    usage->bytes = mem->segmentCapacity * sizeof(*mem->segments)
+                   + usage->decodedBytes + mem->mappingSize;
+    for (uint32_t i = 0; i < mem->segmentCount; i++) {
+        if (is_mapped(mem, i)) {
+            Segment *seg = mem->segments[i].segment;
+            usage->segments++;
+            usage->words += seg->length;
+            usage->bytes += host_bytes(seg);
+        }
     }
-
-    Seq_free(&unmapped);
-    Seq_put(mem->memory, *identifier, NULL);
+    usage->peakSegments = usage->segments;
+    usage->peakWords = usage->words;
+    usage->peakBytes = usage->bytes;
+    note_usage(mem);
 }
 
-int get_counter(umStorage *mem)
+void set_usage_limit(umStorage *mem, size_t limit)
 {
-    mem->counter++;
-    return mem->counter - 1;
+    mem->usage.limit = limit;
+    note_usage(mem);
 }
 
-Seq_T *get_main_mem(umStorage *mem)
+void remove_segment(umStorage *mem, uint32_t identifier)
 {
-    return &mem->memory;
+    Segment *seg = get_segment(mem, identifier);
+
+    if (identifier == 0) {
+        mem->program = NULL;
+        mem->programLength = 0;
+    }
+
+    mem->segments[identifier].nextFree = ((uintptr_t)mem->freeID << 1) | 1;
+    mem->freeID = identifier;
+    count_unmapped(mem, seg);
+    free_segment(seg);
 }
 
-uint32_t get_next_instruction(umStorage *mem)
+Segment *get_writable_segment(umStorage *mem, uint32_t identifier)
 {
-    Seq_T segZero = Seq_get(mem->memory, 0);
-    return *(uint32_t *)Seq_get(segZero, get_counter(mem));
+    Segment *seg = get_segment(mem, identifier);
+    if (seg->refs > 1) {
+        Segment *copy = new_segment(seg->length);
+        memcpy(copy->words, seg->words, seg->length * sizeof(uint32_t));
+        replace_segment(mem, identifier, copy);
+        seg = copy;
+    }
+    return seg;
 }
 
-uint32_t get_reg_val(umStorage *mem, int index)
+void replace_segment(umStorage *mem, uint32_t identifier, Segment *seg)
 {
-    assert(index >= 0 && index < 8)
-;   return *(uint32_t*)Seq_get(mem->registers, index);
+    /* the old segment goes before anything that can fail on the memory
+     * limit, so a failure leaves nothing outside the segment table
+     */
+    Segment *old = get_segment(mem, identifier);
+    mem->segments[identifier].segment = seg;
+    count_unmapped(mem, old);
+    free_segment(old);
+    if (identifier == 0) {
+        set_seg_zero(mem, seg);
+    }
+    count_mapped(mem, seg);
 }
 
-void edit_register(umStorage *mem, int index, uint32_t value)
+void decode_fused(umStorage *mem, uint32_t index)
 {
-    assert(index >= 0 && index < 8);
-    *(uint32_t*)Seq_get(mem->registers, index) = value;
+    Decoded *decoded = &mem->decoded[index];
+    decode_instruction(decoded, mem->program[index]);
+    if (index + 1 < mem->programLength) {
+        uint8_t op = pair_op(mem->program[index], mem->program[index + 1]);
+        if (op != decoded->op) {
+            /* the fused handler reads the operands of the second record */
+            if (decoded[1].op == UM_UNDECODED) {
+                decode_instruction(&decoded[1], mem->program[index + 1]);
+            }
+            decoded->op = op;
+        }
+    }
 }
 
-void edit_counter(umStorage *mem, int setTo)
+void decode_instruction(Decoded *decoded, uint32_t instruction)
 {
-    int max = Seq_length(Seq_get(mem->memory, 0));
-    assert(setTo >= 0 && setTo < max);
-    mem->counter = setTo;
+    decoded->op = instruction >> 28;
+    if (decoded->op == 13) {
+        decoded->a = (instruction >> 25) & 7;
+        decoded->b = 0;
+        decoded->c = 0;
+        decoded->value = instruction & 33554431;   /* 25 ones in binary */
+    } else {
+        decoded->a = (instruction >> 6) & 7;
+        decoded->b = (instruction >> 3) & 7;
+        decoded->c = instruction & 7;
+        decoded->value = 0;
+    }
 }
\ No newline at end of file
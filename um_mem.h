@@ -9,70 +9,336 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <setjmp.h>
 #include "assert.h"
-#include "seq.h"
+#include "um_io.h"
 
 #ifndef UM_MEM_H
 #define UM_MEM_H
 
-typedef struct umStorage umStorage;
+/* The um makes two kinds of checks. debug_assert checks the um's own
+ * invariants, such as register indices, which are 3 bit fields of the
+ * instruction and cannot be out of range; only the checked debug build
+ * ('make BUILD=debug', which defines UM_DEBUG) makes them. um_check checks
+ * the failures the um spec lets a program cause: segment bounds, unmapped
+ * segments, division by zero and output above 255. The debug build asserts
+ * them, and the release build reports them through um_fail.
+ */
+#ifdef UM_DEBUG
+#define debug_assert(e) assert(e)
+#define um_check(e, failure) assert(e)
+#else
+#define debug_assert(e) ((void)0)
+#define um_check(e, failure) do {                   \
+        if (__builtin_expect(!(e), 0)) {            \
+            um_fail(failure);                       \
+        }                                           \
+    } while (0)
+#endif
+
+/* Where um_fail returns to on a thread that runs machines for someone
+ * else, so a failing program ends only its own machine: the thread points
+ * um_recovery at one of these, calls setjmp on env, and on a failure gets
+ * back there with failure set. The machine is then only fit for
+ * release_memory.
+ */
+typedef struct umRecovery {
+    jmp_buf env;
+    const char *failure;
+} umRecovery;
+
+extern __thread umRecovery *um_recovery;
+
+/* Takes in a description of a failure of the running program. Function
+ * jumps to the thread's um_recovery with it if there is one, and otherwise
+ * reports it on stderr and exits with a failure status. The description
+ * stays valid until the thread's next failure.
+ */
+void um_fail(const char *failure) __attribute__((noreturn, cold));
+
+/* A segment is a single contiguous block of words prefixed by its length,
+ * so that loading or storing a word is one indexed access. A segment can be
+ * mapped at more than one identifier at once (loadProgram shares the source
+ * segment with segment 0), refs counts the identifiers it is mapped at, and
+ * it is copied before it is written while refs is more than 1. A segment
+ * with SEGMENT_BORROWED in flags lives in storage the um does not own (a
+ * mapped snapshot) and is never freed; the other flags record which
+ * allocator new_segment took the segment from.
+ */
+typedef struct Segment {
+    uint32_t length;
+    uint32_t refs;
+    uint32_t flags;
+    uint32_t words[];
+} Segment;
+
+enum {
+    SEGMENT_BORROWED = 1,
+    SEGMENT_SMALL = 2,              /* a block of a size class */
+    SEGMENT_LARGE = 4               /* its own anonymous mapping */
+};
+
+/* An instruction of segment 0 decoded once ahead of execution. Op codes
+ * 0-15 are the um op codes; the two values past them mark a record that has
+ * not been decoded yet, and the record just past the end of segment 0. The
+ * values after those mark the first record of a pair of instructions run
+ * together by one handler (see set_seg_zero); the operand fields of such a
+ * record are still those of its own instruction.
+ */
+typedef struct Decoded {
+    uint8_t op;
+    uint8_t a;
+    uint8_t b;
+    uint8_t c;
+    uint32_t value;
+} Decoded;
+
+enum {
+    UM_UNDECODED = 16,
+    UM_PAST_END,
+    UM_FUSED_LOADVAL_ADD,           /* first fused op code */
+    UM_FUSED_LOADVAL_SEGLOAD,
+    UM_FUSED_LOADVAL_JUMP,          /* loadval then loadProgram */
+    UM_FUSED_NAND_NAND,
+    UM_FUSED_CMOVE_JUMP,            /* cMove then loadProgram */
+    UM_OP_COUNT
+};
+
+#define UM_FIRST_FUSED UM_FUSED_LOADVAL_ADD
+
+/* An entry of the segment table. A mapped identifier holds its segment. An
+ * unmapped identifier holds the next unmapped identifier shifted left with
+ * the low bit set (segments are aligned, so a segment pointer never has it),
+ * which makes the unmapped identifiers a stack threaded through the table.
+ */
+typedef union SegmentSlot {
+    Segment *segment;
+    uintptr_t nextFree;
+} SegmentSlot;
+
+/* Memory held by a machine, kept up to date as segments are mapped and
+ * unmapped. Host bytes are the blocks the mapped segments really occupy
+ * (after rounding up to a size class or to whole pages, and counting a
+ * segment mapped at several identifiers once), the segment table, the
+ * decoded records of segment 0 and a restored snapshot. Each peak is the
+ * largest its count has been. When limit is not 0 the program fails as
+ * soon as its host bytes pass it.
+ */
+typedef struct umUsage {
+    uint32_t segments;              /* mapped identifiers */
+    uint32_t peakSegments;
+    uint64_t words;                 /* words in the mapped segments */
+    uint64_t peakWords;
+    size_t bytes;                   /* host memory */
+    size_t peakBytes;
+    size_t decodedBytes;            /* of bytes, the decoded records */
+    size_t limit;                   /* most host bytes allowed, or 0 */
+} umUsage;
+
+/* Main memory of the um. The fields touched by every instruction (the
+ * registers, the program counter, the instruction published for the
+ * profiler, and the words and decoded records of segment 0) are kept
+ * together at the front so they share one cache line.
+ */
+typedef struct umStorage {
+    uint32_t registers[8];
+    uint32_t counter;
+    uint32_t programLength;
+    uint64_t executing;             /* programID << 32 | pc being run, kept
+                                       only for the profiler and tracer */
+    uint32_t *program;
+    Decoded *decoded;
+    SegmentSlot *segments;
+    uint32_t segmentCount;          /* identifiers handed out so far */
+    uint32_t segmentCapacity;
+    uint32_t freeID;                /* last unmapped identifier, or NO_ID */
+    uint32_t programID;             /* segment last loaded as segment 0 */
+    void *mapping;                  /* restored snapshot, or NULL */
+    size_t mappingSize;
+    umIO *io;                       /* where output and input go */
+    struct umTrace *trace;          /* being recorded or replayed, or NULL */
+    umUsage usage;
+} umStorage;
+
+/* marks the end of the stack of unmapped identifiers */
+#define NO_ID UINT32_MAX
 
 /* Allocates space for the main memory used by the um. Initializes 8
  * registers, as well as the memory pool, and the list of unmapped identifiers,
- * and sets the program counter to zero. It is a checked runtime error that 
- * memory is able to be allocated.
+ * and sets the program counter to zero. Output and input go to stdout and
+ * come from stdin until mem->io is replaced. It is a checked runtime error
+ * that memory is able to be allocated.
  */
 umStorage* initialize_memory();
 
 /* Takes in a pointer to the um memory, and frees all associated memory
- * used by the um.
+ * used by the um, flushing its output first.
  */
 void release_memory(umStorage *mem);
 
-/* Takes in apointer to um memory, and a sequence of words to be stored. 
- * Adds a new segment containing words to the back of the memory pool, or to 
- * the index of the last unmapped segment.
+/* Takes in the number of words in a segment. Function allocates a new segment
+ * with every word set to zero. Small segments come from per thread caches of
+ * freed blocks, and large ones are mapped from the kernel, so their pages
+ * are only zeroed when first touched. It is a checked runtime error that
+ * memory is able to be allocated.
+ */
+Segment *new_segment(uint32_t length);
+
+/* Takes in a pointer to a segment, or NULL. Function drops one reference to
+ * the segment and frees it once no identifier maps it.
+ */
+void free_segment(Segment *seg);
+
+/* Function frees the blocks cached by the calling thread for reuse by
+ * new_segment. A thread that has run machines calls it before it exits,
+ * since the cache is not freed with the thread.
  */
-uint32_t add_segment(Seq_T words, umStorage *mem);
+void release_thread_cache(void);
+
+/* Takes in a pointer to a segment. Function adds a reference to the segment
+ * so it can be mapped at one more identifier, and returns it.
+ */
+Segment *share_segment(Segment *seg);
+
+/* Takes in apointer to um memory, and a segment of words to be stored. 
+ * Adds the segment at the most recently unmapped identifier, whose slot is
+ * likely still in cache, or at the end of the segment table if none is
+ * unmapped.
+ */
+uint32_t add_segment(Segment *words, umStorage *mem);
+
+/* Takes in a pointer to the um memory whose segment table was filled in
+ * directly (by restoring a snapshot). Function makes the segment mapped at
+ * identifier 0 the running program and decodes it.
+ */
+void attach_seg_zero(umStorage *mem);
+
+/* Takes in a pointer to the um memory whose segment table was filled in
+ * directly (by restoring a snapshot). Function counts its usage again from
+ * the table, starting its peaks there.
+ */
+void recount_usage(umStorage *mem);
+
+/* Takes in a pointer to the um memory and a number of host bytes, 0 for no
+ * limit. Function sets the memory limit, and fails the program at once if
+ * the memory already holds more than that.
+ */
+void set_usage_limit(umStorage *mem, size_t limit);
 
 /* Takes in a poiter to the um memory and the identifier corrosponding to the 
  * segment to be unmapped. Function allows identifier to be mapped over the 
- * next time a new segment is mapped.
+ * next time a new segment is mapped. It is a checked runtime error that the
+ * segment is mapped.
  */
-void remove_segment(umStorage *mem, uint32_t *identifier);
+void remove_segment(umStorage *mem, uint32_t identifier);
 
-/* Takes in a pointer to the um memory. Function returns the index of segment
- * zero that the counter is pointing to, and increments the counter.
+/* Takes in a pointer to the um memory and a segment identifier. Function
+ * returns true if a segment is mapped at that identifier.
+ */
+static inline bool is_mapped(umStorage *mem, uint32_t identifier)
+{
+    return identifier < mem->segmentCount &&
+           (mem->segments[identifier].nextFree & 1) == 0;
+}
+
+/* Takes in a pointer to the um memory and a segment identifier. Function
+ * returns the segment mapped at that identifier. It is a um failure if the
+ * segment is not mapped.
+ */
+static inline Segment *get_segment(umStorage *mem, uint32_t identifier)
+{
+    um_check(is_mapped(mem, identifier), "segment is not mapped");
+    return mem->segments[identifier].segment;
+}
+
+/* Takes in a pointer to the um memory and a segment identifier. Function
+ * returns the segment mapped at that identifier ready to be written: if its
+ * words are shared with another identifier they are copied first, and the
+ * copy is mapped in place of the shared segment. It is a checked runtime
+ * error that the segment is mapped.
+ */
+Segment *get_writable_segment(umStorage *mem, uint32_t identifier);
+
+/* Takes in a pointer to the um memory, a segment identifier and a new
+ * segment. Function maps the new segment at the identifier and frees the
+ * segment that was previously mapped there.
+ */
+void replace_segment(umStorage *mem, uint32_t identifier, Segment *seg);
+
+/* Takes in a pointer to a decoded record and a coded instruction. Function
+ * splits the instruction into its op code, registers and 25 bit value and
+ * stores them in the record.
  */
-int get_counter(umStorage *mem);
+void decode_instruction(Decoded *decoded, uint32_t instruction);
 
-/* Takes in a pointer to the um memory. Function returns the main memory field
- * in the um memory.
+/* Takes in a pointer to the um memory and an index into segment 0. Function
+ * decodes the word at the index into its record, fusing it with the next
+ * word when the two form a fusable pair.
+ */
+void decode_fused(umStorage *mem, uint32_t index);
+
+/* Takes in a pointer to the um memory and an index into segment 0. Function
+ * marks the decoded record at the index as stale, so it is decoded again
+ * before it next runs. Called whenever a word of segment 0 is overwritten.
+ */
+static inline void invalidate_instruction(umStorage *mem, uint32_t index)
+{
+    mem->decoded[index].op = UM_UNDECODED;
+    /* a pair ending at the index has to be fused again */
+    if (index > 0 && mem->decoded[index - 1].op >= UM_FIRST_FUSED) {
+        mem->decoded[index - 1].op = UM_UNDECODED;
+    }
+}
+
+/* Takes in a pointer to the um memory. Function returns the index of segment
+ * zero that the counter is pointing to, and increments the counter.
  */
-Seq_T *get_main_mem(umStorage *mem);
+static inline int get_counter(umStorage *mem)
+{
+    return mem->counter++;
+}
 
 /* Takes in a pointer to the um memory. Function returns the next word in the 
  * 0th element of main memory, which is the next coded instrucion.
  */
-uint32_t get_next_instruction(umStorage *mem);
+static inline uint32_t get_next_instruction(umStorage *mem)
+{
+    um_check(mem->counter < mem->programLength,
+             "program counter ran off the end of segment 0");
+    return mem->program[mem->counter++];
+}
 
 /* Takes in a pointer to the um memory, and the index of a register. Function
- * returns the value in the register with the corrosponding index. It is a
- * checked runtime error that the index is between [0-7].
+ * returns the value in the register with the corrosponding index. The index
+ * is between [0-7], which only the debug build checks.
  */
-uint32_t get_reg_val(umStorage *mem, int index);
+static inline uint32_t get_reg_val(umStorage *mem, int index)
+{
+    debug_assert(index >= 0 && index < 8);
+    return mem->registers[index];
+}
 
 /* Takes in a pointer to the um memory, the index of a register, and a 32 bit
  * value. Function stores the 32 bit value into the register indicated by the
- * index. It is a checked runtime error that the index is between [0-7].
+ * index. The index is between [0-7], which only the debug build checks.
  */
-void edit_register(umStorage *mem, int index, uint32_t value);
+static inline void edit_register(umStorage *mem, int index, uint32_t value)
+{
+    debug_assert(index >= 0 && index < 8);
+    mem->registers[index] = value;
+}
 
 /* Takes in a pointer to the um memory, and the value the counter will be set
- * to. Function sets the program counter the indicated value. It is a checked
- * runtime error to set the counter to a negative number or a value greater
- * than the size of the 0th index.
+ * to. Function sets the program counter the indicated value. It is a um
+ * failure to set the counter to a negative number or a value greater than
+ * the size of the 0th index.
  */
-void edit_counter(umStorage *mem, int setTo);
+static inline void edit_counter(umStorage *mem, int setTo)
+{
+    um_check(setTo >= 0 && (uint32_t)setTo < mem->programLength,
+             "loadProgram jumped outside segment 0");
+    mem->counter = setTo;
+}
 
 #endif
\ No newline at end of file
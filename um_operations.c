@@ -8,15 +8,20 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 #include <bitpack.h>
 #include "um_operations.h"
+#include "um_threaded.h"
+#include "um_jit.h"
+#include "um_snapshot.h"
+#include "um_trace.h"
 
 void cMove(umStorage *mem, int a, int b, int c)
 {
-    assert(a >= 0 && a < 8);
-    assert(b >= 0 && b < 8);
-    assert(c >= 0 && c < 8);
+    debug_assert(a >= 0 && a < 8);
+    debug_assert(b >= 0 && b < 8);
+    debug_assert(c >= 0 && c < 8);
 
     if (get_reg_val(mem, c) != 0){
         uint32_t toSet = get_reg_val(mem, b);
@@ -26,37 +31,39 @@ void cMove(umStorage *mem, int a, int b, int c)
 
 void segLoad(umStorage *mem, int a, int b, int c)
 {
-    assert(a >= 0 && a < 8);
-    assert(b >= 0 && b < 8);
-    assert(c >= 0 && c < 8);
+    debug_assert(a >= 0 && a < 8);
+    debug_assert(b >= 0 && b < 8);
+    debug_assert(c >= 0 && c < 8);
 
     uint32_t rb = get_reg_val(mem, b);
     uint32_t rc = get_reg_val(mem, c);
-    Seq_T segToRead = Seq_get(*(Seq_T*)get_main_mem(mem), rb);
-    uint32_t toLoad = *(uint32_t*)Seq_get(segToRead, rc);
-    edit_register(mem, a, toLoad);
+    Segment *segToRead = get_segment(mem, rb);
+    um_check(rc < segToRead->length, "segment load out of bounds");
+    edit_register(mem, a, segToRead->words[rc]);
 }
 
 void segStore(umStorage *mem, int a, int b, int c)
 {
-    assert(a >= 0 && a < 8);
-    assert(b >= 0 && b < 8);
-    assert(c >= 0 && c < 8);
+    debug_assert(a >= 0 && a < 8);
+    debug_assert(b >= 0 && b < 8);
+    debug_assert(c >= 0 && c < 8);
 
     uint32_t ra = get_reg_val(mem, a);
     uint32_t rb = get_reg_val(mem, b);
-    uint32_t *store = malloc(sizeof(*store));
-    assert(store != NULL);
+    Segment *segToWrite = get_writable_segment(mem, ra);
+    um_check(rb < segToWrite->length, "segment store out of bounds");
+    segToWrite->words[rb] = get_reg_val(mem, c);
 
-    *store = get_reg_val(mem, c);
-    free(Seq_put(Seq_get(*(Seq_T*)get_main_mem(mem), ra), rb, store));
+    if (ra == 0) {
+        invalidate_instruction(mem, rb);
+    }
 }
 
 void add(umStorage *mem, int a, int b, int c)
 {
-    assert(a >= 0 && a < 8);
-    assert(b >= 0 && b < 8);
-    assert(c >= 0 && c < 8);
+    debug_assert(a >= 0 && a < 8);
+    debug_assert(b >= 0 && b < 8);
+    debug_assert(c >= 0 && c < 8);
     
     uint32_t rb = get_reg_val(mem, b);
     uint32_t rc = get_reg_val(mem, c);
@@ -66,9 +73,9 @@ void add(umStorage *mem, int a, int b, int c)
 
 void multiply(umStorage *mem, int a, int b, int c)
 {
-    assert(a >= 0 && a < 8);
-    assert(b >= 0 && b < 8);
-    assert(c >= 0 && c < 8);
+    debug_assert(a >= 0 && a < 8);
+    debug_assert(b >= 0 && b < 8);
+    debug_assert(c >= 0 && c < 8);
     
     uint32_t rb = get_reg_val(mem, b);
     uint32_t rc = get_reg_val(mem, c);
@@ -78,21 +85,22 @@ void multiply(umStorage *mem, int a, int b, int c)
 
 void divide(umStorage *mem, int a, int b, int c)
 {
-    assert(a >= 0 && a < 8);
-    assert(b >= 0 && b < 8);
-    assert(c >= 0 && c < 8);
+    debug_assert(a >= 0 && a < 8);
+    debug_assert(b >= 0 && b < 8);
+    debug_assert(c >= 0 && c < 8);
     
     uint32_t rb = get_reg_val(mem, b);
     uint32_t rc = get_reg_val(mem, c);
+    um_check(rc != 0, "division by zero");
     uint32_t value = rb / rc;
     edit_register(mem, a, value);
 }
 
 void nand(umStorage *mem, int a, int b, int c)
 {
-    assert(a >= 0 && a < 8);
-    assert(b >= 0 && b < 8);
-    assert(c >= 0 && c < 8);
+    debug_assert(a >= 0 && a < 8);
+    debug_assert(b >= 0 && b < 8);
+    debug_assert(c >= 0 && c < 8);
     
     uint32_t rb = get_reg_val(mem, b);
     uint32_t rc = get_reg_val(mem, c);
@@ -102,82 +110,63 @@ void nand(umStorage *mem, int a, int b, int c)
 
 void mapSegment(umStorage *mem, int b, int c)
 {
-    assert(b >= 0 && b < 8);
-    assert(c >= 0 && c < 8);
+    debug_assert(b >= 0 && b < 8);
+    debug_assert(c >= 0 && c < 8);
     
     uint32_t length = get_reg_val(mem, c);
-    Seq_T newSeg = Seq_new(length);
-
-    for (uint32_t i = 0; i < length; i++) {
-        uint32_t *zeroPtr = malloc(sizeof(*zeroPtr));
-        assert(zeroPtr != NULL);
-        *zeroPtr = 0;
-        Seq_addhi(newSeg, zeroPtr);
-    }
+    Segment *newSeg = new_segment(length);
 
     uint32_t id = add_segment(newSeg, mem);
+    if (mem->trace != NULL) {
+        trace_map(mem->trace, mem, id);
+    }
     edit_register(mem, b, id);
 }
 
 void unmapSegment(umStorage *mem, int c)
 {
-    assert(c >= 0 && c < 8);
+    debug_assert(c >= 0 && c < 8);
     
     uint32_t rc = get_reg_val(mem, c);
-    uint32_t *rcPntr = malloc(sizeof(*rcPntr));
-    assert(rcPntr != NULL);
-    *rcPntr = rc;
-    remove_segment(mem, rcPntr);
+    um_check(rc != 0, "unmap of segment 0");
+    if (mem->trace != NULL) {
+        trace_unmap(mem->trace, mem, rc);
+    }
+    remove_segment(mem, rc);
 }
 
 void output(umStorage *mem, int c)
 {
-    assert(c >= 0 && c < 8);
+    debug_assert(c >= 0 && c < 8);
 
     uint32_t rc = get_reg_val(mem, c);
-    assert(rc < 256);
+    um_check(rc < 256, "output of a value above 255");
 
-    putchar(rc);
+    io_put(mem->io, rc);
 }
 
 void input(umStorage *mem, int c)
 {
-    assert(c >= 0 && c < 8);
-
-    char input;
-    scanf("%c", &input);
+    debug_assert(c >= 0 && c < 8);
 
-    if (input == EOF) {
-        uint32_t value = ~0;
-        edit_register(mem, c, value);
-    }
-    edit_register(mem, c, input);
+    /* all ones once the input has ended; a trace records or replays it */
+    uint32_t value = mem->trace != NULL ? trace_input(mem->trace, mem)
+                                        : io_get(mem->io);
+    edit_register(mem, c, value);
 }
 
 void loadProgram(umStorage *mem, int b, int c)
 {
-    assert(b >= 0 && b < 8);
-    assert(c >= 0 && c < 8);
+    debug_assert(b >= 0 && b < 8);
+    debug_assert(c >= 0 && c < 8);
 
+    /* with rb == 0 this is only a jump */
     uint32_t rb = get_reg_val(mem, b);
     if (rb != 0){
-        Seq_T source = Seq_get(*(Seq_T*)get_main_mem(mem), rb);
-        int length = Seq_length(source);
-        Seq_T duplicate = Seq_new(length);
-
-        for (int i = 0; i < length; i++) {
-            uint32_t *copy = malloc(sizeof(*copy));
-            assert(copy != NULL);
-            *copy = *(uint32_t*)Seq_get(source, i);
-            Seq_addhi(duplicate, copy);
-        }
-
-        Seq_T temp = Seq_put(*(Seq_T*)get_main_mem(mem), 0, duplicate);
-        int tempSize = Seq_length(temp);
-        for (int j = 0; j < tempSize; j++) {
-            free(Seq_get(temp, j));
-        }
-        Seq_free(&temp);
+        /* segment 0 shares the source's words until either is written */
+        Segment *source = share_segment(get_segment(mem, rb));
+        replace_segment(mem, 0, source);
+        mem->programID = rb;
     }
     int rc = get_reg_val(mem, c);
     edit_counter(mem, rc);
@@ -185,6 +174,138 @@ void loadProgram(umStorage *mem, int b, int c)
 
 void loadVal(umStorage *mem, uint32_t value, int a)
 {
-    assert(a >= 0 && a < 8);
+    debug_assert(a >= 0 && a < 8);
     edit_register(mem, a, value);
+}
+
+/* counts the instruction about to run, along with the operands of the
+ * ops whose cost depends on them
+ */
+static void record_instruction(umStorage *mem, umStats *stats,
+                               uint32_t opCode, uint32_t instruction)
+{
+    uint32_t rb = get_reg_val(mem, (instruction >> 3) & 7);
+    uint32_t rc = get_reg_val(mem, instruction & 7);
+
+    stats->instructions++;
+    stats->opcodes[opCode]++;
+    if (opCode == 8) {
+        stats->maps++;
+        stats->mapSizes[stats_size_bucket(rc)]++;
+    } else if (opCode == 9) {
+        stats->unmaps++;
+    } else if (opCode == 12 && rb == 0) {
+        stats->jumps++;
+    } else if (opCode == 12 && is_mapped(mem, rb)) {
+        stats->loads++;
+        stats->wordsLoaded += get_segment(mem, rb)->length;
+    }
+}
+
+/* Executes one instruction, recording it in stats unless stats is NULL.
+ * Every caller passes a constant, so the recording is compiled away from
+ * run_instruction.
+ */
+static inline __attribute__((always_inline))
+bool execute(umStorage *mem, umStats *stats)
+{
+    uint32_t instruction = get_next_instruction(mem);
+
+    uint32_t opCode = instruction >> 28; 
+    if (stats != NULL) {
+        record_instruction(mem, stats, opCode, instruction);
+    }
+
+    if (opCode == 13) {
+        uint32_t a = 7;
+        a = a << 25;
+        a = (a & instruction) >> 25;
+        uint32_t value = 33554431;   /* 25 ones in binary */
+        value = value & instruction;
+        loadVal(mem, value, a);
+    }
+
+    else{
+        uint32_t a = ((7 << 6) & instruction) >> 6;
+        uint32_t b = ((7 << 3) & instruction) >> 3;
+        uint32_t c = 7 & instruction;
+
+        if (opCode == 0){
+            cMove(mem, a, b, c);
+        }
+        else if (opCode == 1){
+            segLoad(mem, a, b, c);
+        }
+        else if (opCode == 2){
+            segStore(mem, a, b, c);
+        }
+        else if (opCode == 3){
+            add(mem, a, b, c);
+        }
+        else if (opCode == 4){
+            multiply(mem, a, b, c); 
+        }
+        else if (opCode == 5){
+            divide(mem, a, b, c);
+        }
+        else if (opCode == 6){
+            nand(mem, a, b, c);
+        }
+        else if (opCode == 7){
+            return true;    
+        }
+        else if (opCode == 8){
+            mapSegment(mem, b, c);
+        }
+        else if (opCode == 9){
+            unmapSegment(mem, c);
+        }   
+        else if (opCode == 10){
+            output(mem, c);
+        }
+        else if (opCode == 11){
+            input(mem, c);
+        }
+        else if (opCode == 12){
+            loadProgram(mem, b, c);
+        }
+        else {
+            fprintf(stderr, "Unkown Command\n");
+            return true;
+        }
+    }
+    return false;
+}
+
+bool run_instruction(umStorage *mem)
+{
+    return execute(mem, NULL);
+}
+
+#ifndef UM_NO_STATS
+bool run_instruction_stats(umStorage *mem, umStats *stats)
+{
+    return execute(mem, stats);
+}
+#endif
+
+bool run_engine(umStorage *mem, const char *engine)
+{
+    if (strcmp(engine, "jit") == 0) {
+        run_jit(mem);
+    } else if (strcmp(engine, "threaded") == 0) {
+        run_threaded(mem);
+    } else if (strcmp(engine, "loop") == 0) {
+        /* loops through instructions until halt */
+        bool halt = false;
+        while (!halt) {
+            halt = run_instruction(mem);
+            if (snapshot_requested) {
+                snapshot_take(mem);
+            }
+        }
+    } else {
+        return false;
+    }
+    return true;
 }
\ No newline at end of file
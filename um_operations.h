@@ -7,10 +7,12 @@
  **/
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <assert.h>
 #include <bitpack.h>
 #include "um_mem.h"
+#include "um_stats.h"
 
 #ifndef UM_OPERATIONS_H
 #define UM_OPERATIONS_H
@@ -86,8 +88,8 @@ void output(umStorage *mem, int c);
 
 /* Takes in a pointer to the um's main memory, as well as an index 
  * indicating a register number. Function will take an input between [0-255]
- * and store the value in reg c. It is a checked runtime error that c is
- * between [0 -7] 
+ * and store the value in reg c, or all ones once the input has ended. It is
+ * a checked runtime error that c is between [0 -7] 
  */
 void input(umStorage *mem, int c);
 
@@ -95,7 +97,8 @@ void input(umStorage *mem, int c);
  * indicating register numbers. Function will create a duplicate of the value
  * in reg b and replace the program segment [0] with it. Program counter set to
  * point to the index equal to reg c.It is a checked runtime error that b and
- * c are between [0 -7] 
+ * c are between [0 -7]. When reg b is 0 this is only a jump; otherwise the
+ * duplicate shares the words of the source segment until either is written.
  */
 void loadProgram(umStorage *mem, int b, int c);
 
@@ -105,4 +108,26 @@ void loadProgram(umStorage *mem, int b, int c);
  */
 void loadVal(umStorage *mem, uint32_t value, int a);
 
+/* Takes in a pointer to the um's memory. Function gets the next instruction
+ * from segment 0 and finds the op code, extracts necessary values (depending
+ * on op code) and calls the corrosponding um operation.
+ * Returns true after operation is executed, and false if the op code = halt
+ */
+bool run_instruction(umStorage *mem);
+
+/* Takes in a pointer to the um's memory and the name of an engine ("loop",
+ * "threaded" or "jit"). Function runs the program with that engine until
+ * halt. Returns false, without running anything, if there is no engine by
+ * that name.
+ */
+bool run_engine(umStorage *mem, const char *engine);
+
+#ifndef UM_NO_STATS
+/* Takes in a pointer to the um's memory and to the statistics being
+ * gathered. Function runs the next instruction like run_instruction and
+ * records it in the statistics.
+ */
+bool run_instruction_stats(umStorage *mem, umStats *stats);
+#endif
+
 #endif
\ No newline at end of file
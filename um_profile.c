@@ -0,0 +1,148 @@
+/**
+ ** um_profile.c
+ ** Purpose: Implementation of the sampling profiler. A SIGPROF handler
+ ** reads the program and pc published by the engine and counts them in a
+ ** fixed size open addressing table, so the handler never allocates. With
+ ** the default rate of 1000 samples per second of cpu time the cost of the
+ ** handler itself is well under a percent.
+ **/
+
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/time.h>
+#include "um_profile.h"
+#include "um_disasm.h"
+
+/* distinct (program, pc) pairs kept; samples of further pairs are dropped */
+#define PROFILE_SLOTS (1 << 16)
+
+typedef struct Sample {
+    uint64_t key;                   /* program << 32 | pc */
+    uint64_t count;                 /* 0 for an empty slot */
+} Sample;
+
+static Sample histogram[PROFILE_SLOTS];
+static volatile sig_atomic_t dropped = 0;
+static uint64_t total = 0;
+static unsigned rate = 0;
+static umStorage *volatile profiled = NULL;
+
+static void sample(int signal)
+{
+    (void)signal;
+    umStorage *mem = profiled;
+    if (mem == NULL) {
+        return;
+    }
+    /* published as one word, so the program and pc always match */
+    uint64_t key = *(volatile uint64_t *)&mem->executing;
+
+    uint32_t slot = (uint32_t)((key * 0x9e3779b97f4a7c15ull) >> 48);
+    for (int probe = 0; probe < PROFILE_SLOTS; probe++) {
+        Sample *s = &histogram[(slot + probe) & (PROFILE_SLOTS - 1)];
+        if (s->count == 0) {
+            s->key = key;
+        }
+        if (s->key == key) {
+            s->count++;
+            total++;
+            return;
+        }
+    }
+    dropped = dropped + 1;
+}
+
+static void set_timer(unsigned hz)
+{
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    if (hz > 0) {
+        timer.it_interval.tv_usec = 1000000 / hz;
+        timer.it_value = timer.it_interval;
+    }
+    setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+void profile_start(umStorage *mem, unsigned hz)
+{
+    assert(hz > 0 && hz <= 1000000);
+    mem->executing = (uint64_t)mem->programID << 32 | mem->counter;
+    profiled = mem;
+    rate = hz;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = sample;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, NULL);
+    set_timer(hz);
+}
+
+void profile_stop(void)
+{
+    set_timer(0);
+    profiled = NULL;
+}
+
+static int by_count(const void *a, const void *b)
+{
+    const Sample *x = a;
+    const Sample *y = b;
+    return (y->count > x->count) - (y->count < x->count);
+}
+
+/* sorts the used slots to the front, most sampled first, and returns how
+ * many there are
+ */
+static int sort_histogram(void)
+{
+    int used = 0;
+    for (int i = 0; i < PROFILE_SLOTS; i++) {
+        if (histogram[i].count != 0) {
+            histogram[used++] = histogram[i];
+        }
+    }
+    memset(&histogram[used], 0, (PROFILE_SLOTS - used) * sizeof(Sample));
+    qsort(histogram, used, sizeof(Sample), by_count);
+    return used;
+}
+
+void profile_report(umStorage *mem, int top, FILE *fp)
+{
+    int used = sort_histogram();
+    fprintf(fp, "profile: %llu samples at %u Hz, %d distinct pcs, %d "
+                "dropped\n", (unsigned long long)total, rate, used,
+            (int)dropped);
+    fprintf(fp, "%10s %7s %8s %10s  %s\n", "samples", "%", "program", "pc",
+            "instruction");
+    for (int i = 0; i < used && i < top; i++) {
+        uint32_t program = histogram[i].key >> 32;
+        uint32_t pc = (uint32_t)histogram[i].key;
+        char text[64] = "(segment 0 since replaced)";
+        if (program == mem->programID && pc < mem->programLength) {
+            disassemble(mem->program[pc], text, sizeof(text));
+        }
+        fprintf(fp, "%10llu %6.2f%% %8u %10u  %s\n",
+                (unsigned long long)histogram[i].count,
+                100.0 * histogram[i].count / (total ? total : 1), program,
+                pc, text);
+    }
+}
+
+bool profile_write(const char *path)
+{
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        return false;
+    }
+    int used = sort_histogram();
+    fprintf(fp, "program\tpc\tsamples\n");
+    for (int i = 0; i < used; i++) {
+        fprintf(fp, "%u\t%u\t%llu\n", (uint32_t)(histogram[i].key >> 32),
+                (uint32_t)histogram[i].key,
+                (unsigned long long)histogram[i].count);
+    }
+    return fclose(fp) == 0;
+}
\ No newline at end of file
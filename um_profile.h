@@ -0,0 +1,35 @@
+/**
+ ** um_profile.h
+ ** Purpose: Interface for the sampling profiler of guest program counters
+ **/
+
+#include <stdio.h>
+#include "um_mem.h"
+
+#ifndef UM_PROFILE_H
+#define UM_PROFILE_H
+
+/* Takes in a pointer to the um's memory and a sampling rate. Function
+ * starts a SIGPROF timer that, at the given rate of cpu time, records the
+ * program counter and the segment last loaded by loadProgram into a
+ * histogram. The engine must keep mem->counter current while profiling.
+ */
+void profile_start(umStorage *mem, unsigned hz);
+
+/* Function stops the timer started by profile_start */
+void profile_stop(void);
+
+/* Takes in a pointer to the um's memory, the number of entries to show and
+ * a stream. Function prints the most sampled program counters with their
+ * instructions, for as long as segment 0 still holds the program they were
+ * sampled in.
+ */
+void profile_report(umStorage *mem, int top, FILE *fp);
+
+/* Takes in the name of a file. Function writes every histogram entry to it
+ * as tab separated "program pc samples" lines, the format umdump reads.
+ * Returns false if the file could not be written.
+ */
+bool profile_write(const char *path);
+
+#endif
\ No newline at end of file
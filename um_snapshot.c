@@ -0,0 +1,301 @@
+/**
+ ** um_snapshot.c
+ ** Purpose: Implementation of machine snapshots. A snapshot file is a
+ ** header holding the registers, program counter and unmapped identifier
+ ** stack, then the segment table with one 64 bit entry per identifier, then
+ ** starting on a page boundary every mapped segment laid out exactly as a
+ ** Segment in memory. Restoring maps the file privately and points the
+ ** segment table straight into it, so segments are only read from disk when
+ ** the program touches them and are copied by the kernel page by page when
+ ** it writes them.
+ **
+ ** A table entry holds the file offset of its segment, or for an unmapped
+ ** identifier the same odd "next << 1 | 1" value the segment table keeps.
+ ** A segment mapped at several identifiers is stored once.
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "um_snapshot.h"
+
+#define SNAPSHOT_MAGIC "UMSNAP1"
+#define SNAPSHOT_VERSION 1
+
+/* segment records start on this boundary, which keeps their addresses even
+ * (as the segment table requires) and their words aligned
+ */
+#define SNAPSHOT_ALIGN 16
+
+typedef struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;            /* sizeof(SnapshotHeader) */
+    uint32_t registers[8];
+    uint32_t counter;
+    uint32_t programID;
+    uint32_t segmentCount;
+    uint32_t freeID;
+    uint64_t dataOffset;            /* page aligned start of the segments */
+    uint64_t size;                  /* size of the whole file */
+} SnapshotHeader;
+
+volatile sig_atomic_t snapshot_requested = 0;
+static const char *signalPath = NULL;
+
+static uint64_t align_up(uint64_t offset, uint64_t alignment)
+{
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+static uint64_t record_size(const Segment *seg)
+{
+    return sizeof(Segment) + (uint64_t)seg->length * sizeof(uint32_t);
+}
+
+static bool write_padding(FILE *fp, uint64_t from, uint64_t to)
+{
+    static const char zeros[SNAPSHOT_ALIGN];
+    while (from < to) {
+        size_t chunk = to - from < sizeof(zeros) ? to - from : sizeof(zeros);
+        if (fwrite(zeros, 1, chunk, fp) != chunk) {
+            return false;
+        }
+        from += chunk;
+    }
+    return true;
+}
+
+/* Takes in the segment table and fills in the file offset of every entry,
+ * giving each segment a record the first time it is seen. Returns the end
+ * of the last record.
+ */
+static uint64_t lay_out(umStorage *mem, uint64_t *slots, uint64_t offset)
+{
+    for (uint32_t i = 0; i < mem->segmentCount; i++) {
+        if (!is_mapped(mem, i)) {
+            slots[i] = mem->segments[i].nextFree;
+            continue;
+        }
+        Segment *seg = mem->segments[i].segment;
+        slots[i] = 0;
+        /* a shared segment keeps the record given to its first identifier */
+        for (uint32_t j = 0; seg->refs > 1 && j < i; j++) {
+            if (is_mapped(mem, j) && mem->segments[j].segment == seg) {
+                slots[i] = slots[j];
+                break;
+            }
+        }
+        if (slots[i] == 0) {
+            slots[i] = offset;
+            offset = align_up(offset + record_size(seg), SNAPSHOT_ALIGN);
+        }
+    }
+    return offset;
+}
+
+bool snapshot_save(umStorage *mem, const char *path)
+{
+    uint32_t count = mem->segmentCount;
+    uint64_t *slots = malloc((count ? count : 1) * sizeof(*slots));
+    assert(slots != NULL);
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.headerSize = sizeof(header);
+    memcpy(header.registers, mem->registers, sizeof(header.registers));
+    header.counter = mem->counter;
+    header.programID = mem->programID;
+    header.segmentCount = count;
+    header.freeID = mem->freeID;
+    header.dataOffset = align_up(sizeof(header) + count * sizeof(*slots),
+                                 (uint64_t)sysconf(_SC_PAGESIZE));
+    header.size = lay_out(mem, slots, header.dataOffset);
+
+    /* written beside the target and renamed, so a reader never sees half a
+     * snapshot
+     */
+    size_t length = strlen(path);
+    char *temporary = malloc(length + 5);
+    assert(temporary != NULL);
+    memcpy(temporary, path, length);
+    strcpy(temporary + length, ".tmp");
+
+    FILE *fp = fopen(temporary, "wb");
+    bool ok = fp != NULL;
+    ok = ok && fwrite(&header, sizeof(header), 1, fp) == 1;
+    ok = ok && fwrite(slots, sizeof(*slots), count, fp) == count;
+    ok = ok && write_padding(fp, sizeof(header) + count * sizeof(*slots),
+                             header.dataOffset);
+
+    uint64_t written = header.dataOffset;
+    for (uint32_t i = 0; ok && i < count; i++) {
+        /* records were laid out in table order, so a segment not yet
+         * written is exactly the one at the current position
+         */
+        if ((slots[i] & 1) || slots[i] != written) {
+            continue;
+        }
+        Segment *seg = mem->segments[i].segment;
+        Segment record = { seg->length, seg->refs, 0 };
+        ok = fwrite(&record, sizeof(record), 1, fp) == 1
+             && fwrite(seg->words, sizeof(uint32_t), seg->length, fp)
+                == seg->length;
+        uint64_t end = written + record_size(seg);
+        written = align_up(end, SNAPSHOT_ALIGN);
+        ok = ok && write_padding(fp, end, written);
+    }
+
+    if (fp != NULL) {
+        ok = fclose(fp) == 0 && ok;
+    }
+    ok = ok && rename(temporary, path) == 0;
+    if (!ok) {
+        remove(temporary);
+    }
+    free(temporary);
+    free(slots);
+    return ok;
+}
+
+static void corrupt(const char *path, const char *why)
+{
+    fprintf(stderr, "um: %s is not a usable snapshot: %s\n", path, why);
+    exit(EXIT_FAILURE);
+}
+
+umStorage *snapshot_restore(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        fprintf(stderr, "um: cannot open %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    uint64_t size = (uint64_t)info.st_size;
+    if (size < sizeof(SnapshotHeader)) {
+        corrupt(path, "too short");
+    }
+    unsigned char *base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "um: cannot map %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    SnapshotHeader *header = (SnapshotHeader *)base;
+    uint32_t count = header->segmentCount;
+    uint64_t *slots = (uint64_t *)(base + sizeof(*header));
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0
+        || header->headerSize != sizeof(*header)) {
+        corrupt(path, "bad header");
+    }
+    if (header->version != SNAPSHOT_VERSION) {
+        corrupt(path, "unsupported version");
+    }
+    if (header->size != size || header->dataOffset > size
+        || sizeof(*header) + (uint64_t)count * sizeof(*slots)
+           > header->dataOffset) {
+        corrupt(path, "truncated");
+    }
+
+    umStorage *mem = initialize_memory();
+    if (count > mem->segmentCapacity) {
+        mem->segmentCapacity = count;
+        mem->segments = realloc(mem->segments,
+                                count * sizeof(*mem->segments));
+        assert(mem->segments != NULL);
+    }
+
+    /* refs is counted again from the table rather than trusted */
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t slot = slots[i];
+        if (slot & 1) {
+            uint64_t next = slot >> 1;
+            if (next != NO_ID && next >= count) {
+                corrupt(path, "bad unmapped identifier");
+            }
+            mem->segments[i].nextFree = slot;
+            continue;
+        }
+        /* written so that a huge slot cannot wrap around past the checks */
+        if (slot < header->dataOffset || slot % SNAPSHOT_ALIGN != 0
+            || size < sizeof(Segment) || slot > size - sizeof(Segment)
+            || record_size((Segment *)(base + slot)) > size - slot) {
+            corrupt(path, "segment outside the file");
+        }
+        Segment *seg = (Segment *)(base + slot);
+        seg->refs = 0;
+        seg->flags = SEGMENT_BORROWED;
+        mem->segments[i].segment = seg;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        if ((slots[i] & 1) == 0) {
+            mem->segments[i].segment->refs++;
+        }
+    }
+    if (count == 0 || (slots[0] & 1) != 0) {
+        corrupt(path, "segment 0 not mapped");
+    }
+    if (header->counter > mem->segments[0].segment->length) {
+        corrupt(path, "program counter outside segment 0");
+    }
+
+    /* every identifier on the unmapped stack must be unmapped and on it
+     * once, or mapping one would overwrite a live segment
+     */
+    bool *listed = calloc(count, sizeof(*listed));
+    assert(listed != NULL);
+    for (uint64_t id = header->freeID; id != NO_ID; id = slots[id] >> 1) {
+        if (id >= count || (slots[id] & 1) == 0 || listed[id]) {
+            corrupt(path, "bad unmapped identifier");
+        }
+        listed[id] = true;
+    }
+    free(listed);
+
+    mem->segmentCount = count;
+    mem->freeID = header->freeID;
+    memcpy(mem->registers, header->registers, sizeof(mem->registers));
+    mem->counter = header->counter;
+    mem->programID = header->programID;
+    mem->mapping = base;
+    mem->mappingSize = size;
+    recount_usage(mem);
+    attach_seg_zero(mem);
+    return mem;
+}
+
+static void request_snapshot(int signal)
+{
+    (void)signal;
+    snapshot_requested = 1;
+}
+
+void snapshot_on_signal(const char *path)
+{
+    signalPath = path;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_snapshot;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, NULL);
+}
+
+void snapshot_take(umStorage *mem)
+{
+    snapshot_requested = 0;
+    if (signalPath != NULL && !snapshot_save(mem, signalPath)) {
+        fprintf(stderr, "um: cannot write snapshot %s\n", signalPath);
+    }
+}
\ No newline at end of file
@@ -0,0 +1,46 @@
+/**
+ ** um_snapshot.h
+ ** Purpose: Interface for saving the whole machine to a snapshot file and
+ ** resuming from one
+ **/
+
+#include <signal.h>
+#include <stdbool.h>
+#include "um_mem.h"
+
+#ifndef UM_SNAPSHOT_H
+#define UM_SNAPSHOT_H
+
+/* Set by SIGUSR1 when a snapshot file was given with snapshot_on_signal.
+ * Engines check it at loadProgram, where the registers and program counter
+ * are all in memory, and call snapshot_take.
+ */
+extern volatile sig_atomic_t snapshot_requested;
+
+/* Takes in a pointer to the um's memory and the name of a file. Function
+ * writes the registers, program counter, every mapped segment and the
+ * unmapped identifiers to the file. Returns false if it could not be
+ * written.
+ */
+bool snapshot_save(umStorage *mem, const char *path);
+
+/* Takes in the name of a snapshot file. Function maps the file and returns
+ * a um memory that resumes where the snapshot was taken. The segments are
+ * used in place from the mapping, so restoring does not read or copy them.
+ * A file that is not a valid snapshot is reported on stderr and ends the
+ * program with EXIT_FAILURE.
+ */
+umStorage *snapshot_restore(const char *path);
+
+/* Takes in the name of a file. Function installs a SIGUSR1 handler that
+ * requests a snapshot into that file.
+ */
+void snapshot_on_signal(const char *path);
+
+/* Takes in a pointer to the um's memory at a point where the registers
+ * and program counter are in memory. Function writes the snapshot asked
+ * for by SIGUSR1 and clears the request.
+ */
+void snapshot_take(umStorage *mem);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,73 @@
+/**
+ ** um_stats.c
+ ** Purpose: Implementation of the report printed by um --stats
+ **/
+
+#include <inttypes.h>
+#include "um_stats.h"
+
+static const char *const OPCODE_NAMES[16] = {
+    "cmove", "segload", "segstore", "add", "multiply", "divide", "nand",
+    "halt", "map", "unmap", "output", "input", "loadprogram", "loadval",
+    "op14", "op15"
+};
+
+static double percent(uint64_t part, uint64_t whole)
+{
+    return whole == 0 ? 0.0 : 100.0 * part / whole;
+}
+
+void stats_print(const umStats *stats, FILE *fp)
+{
+    fprintf(fp, "instructions: %" PRIu64 "\n", stats->instructions);
+    for (int op = 0; op < 16; op++) {
+        if (stats->opcodes[op] != 0) {
+            fprintf(fp, "  %-12s %14" PRIu64 "  %6.2f%%\n", OPCODE_NAMES[op],
+                    stats->opcodes[op],
+                    percent(stats->opcodes[op], stats->instructions));
+        }
+    }
+
+    fprintf(fp, "map: %" PRIu64 "  unmap: %" PRIu64 "\n", stats->maps,
+            stats->unmaps);
+    for (int i = 0; i < STATS_SIZE_BUCKETS; i++) {
+        if (stats->mapSizes[i] == 0) {
+            continue;
+        }
+        if (i == 0) {
+            fprintf(fp, "  size 0                     %14" PRIu64 "\n",
+                    stats->mapSizes[i]);
+        } else {
+            fprintf(fp, "  size %10" PRIu64 "-%-10" PRIu64 " %14" PRIu64
+                    "\n", (uint64_t)1 << (i - 1),
+                    ((uint64_t)1 << i) - 1, stats->mapSizes[i]);
+        }
+    }
+
+    fprintf(fp, "loadprogram: %" PRIu64 " jumps (rb == 0), %" PRIu64
+            " loads (rb != 0) of %" PRIu64 " words\n", stats->jumps,
+            stats->loads, stats->wordsLoaded);
+}
+
+static const char *const FUSION_NAMES[5] = {
+    "loadval+add", "loadval+segload", "loadval+loadprogram", "nand+nand",
+    "cmove+loadprogram"
+};
+
+void fusion_print(const umFusion *fusion, FILE *fp)
+{
+    uint64_t pairs = 0;
+    for (int i = 0; i < 5; i++) {
+        pairs += fusion->pairs[i];
+    }
+    uint64_t instructions = fusion->dispatches + pairs;
+    fprintf(fp, "instructions: %" PRIu64 "  dispatches: %" PRIu64 "\n",
+            instructions, fusion->dispatches);
+    fprintf(fp, "fused: %" PRIu64 " instructions in %" PRIu64
+            " pairs, %.2f%% hit rate\n", 2 * pairs, pairs,
+            percent(2 * pairs, instructions));
+    for (int i = 0; i < 5; i++) {
+        fprintf(fp, "  %-20s %14" PRIu64 "  %6.2f%%\n", FUSION_NAMES[i],
+                fusion->pairs[i], percent(2 * fusion->pairs[i], instructions));
+    }
+}
\ No newline at end of file
@@ -0,0 +1,55 @@
+/**
+ ** um_stats.h
+ ** Purpose: Interface for the execution statistics gathered by um --stats
+ **/
+
+#include <stdint.h>
+#include <stdio.h>
+
+#ifndef UM_STATS_H
+#define UM_STATS_H
+
+/* map sizes are counted in power of two buckets: bucket 0 holds empty
+ * segments and bucket i holds sizes in [2^(i-1), 2^i)
+ */
+#define STATS_SIZE_BUCKETS 33
+
+typedef struct umStats {
+    uint64_t instructions;
+    uint64_t opcodes[16];
+    uint64_t maps;
+    uint64_t unmaps;
+    uint64_t mapSizes[STATS_SIZE_BUCKETS];
+    uint64_t jumps;             /* loadProgram with rb == 0 */
+    uint64_t loads;             /* loadProgram with rb != 0 */
+    uint64_t wordsLoaded;       /* words in the segments loaded as program */
+} umStats;
+
+/* Takes in the length of a segment being mapped. Function returns its
+ * bucket in umStats.mapSizes.
+ */
+static inline int stats_size_bucket(uint32_t length)
+{
+    return length == 0 ? 0 : 32 - __builtin_clz(length);
+}
+
+/* counts gathered by the threaded engine about fused instruction pairs;
+ * every dispatch runs one instruction and every pair runs a second one
+ */
+typedef struct umFusion {
+    uint64_t dispatches;
+    uint64_t pairs[5];          /* by fused op code, from UM_FIRST_FUSED */
+} umFusion;
+
+/* Takes in the gathered statistics and a stream. Function prints a report
+ * of the statistics to the stream.
+ */
+void stats_print(const umStats *stats, FILE *fp);
+
+/* Takes in the fusion counts and a stream. Function prints the number of
+ * instructions run, how many of them ran as part of a fused pair, and the
+ * pairs run of each kind.
+ */
+void fusion_print(const umFusion *fusion, FILE *fp);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,113 @@
+/**
+ ** um_threaded.c
+ ** Purpose: Implementation of the threaded (computed goto) execution
+ ** engine. Instructions are executed from the decoded records of segment 0,
+ ** so steady state execution does no decoding at all. Arithmetic ops work
+ ** on the register file directly, while the ops that manage memory or do
+ ** I/O call into um_operations.
+ **/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "um_operations.h"
+#include "um_threaded.h"
+#include "um_snapshot.h"
+
+/* labels as values are a GNU extension */
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+/* fetches the decoded record at the program counter and jumps straight to
+ * the handler for its op code. The profiled variant also stores the program
+ * and pc of the instruction where a SIGPROF handler can read them, and the
+ * budgeted variant stops before the next instruction once its budget is
+ * spent.
+ */
+#define NEXT() do {                                     \
+        if (BUDGETED) {                                 \
+            if (*budget == 0) {                         \
+                goto out_of_budget;                     \
+            }                                           \
+            (*budget)--;                                \
+        }                                               \
+        if (PUBLISH_PC) {                               \
+            *(volatile uint64_t *)&mem->executing =     \
+                program | pc;                           \
+        }                                               \
+        d = &code[pc++];                                \
+    } while (0)
+
+#define DISPATCH() do {                                 \
+        NEXT();                                         \
+        if (COUNT_FUSION) {                             \
+            fusion->dispatches++;                       \
+        }                                               \
+        goto *dispatch[d->op];                          \
+    } while (0)
+
+/* moves from the first instruction of a fused pair to the second without a
+ * dispatch. The budget is still charged per instruction, so a budgeted run
+ * can stop between the two.
+ */
+#define FUSED_NEXT() do {                                           \
+        if (COUNT_FUSION) {                                         \
+            fusion->pairs[d->op - UM_FIRST_FUSED]++;                \
+        }                                                           \
+        NEXT();                                                     \
+    } while (0)
+
+#define THREADED_ENGINE threaded
+#define PUBLISH_PC 0
+#define BUDGETED 0
+#define COUNT_FUSION 0
+#include "um_threaded_engine.h"
+#undef THREADED_ENGINE
+#undef PUBLISH_PC
+#undef BUDGETED
+#undef COUNT_FUSION
+
+#define THREADED_ENGINE threaded_profiled
+#define PUBLISH_PC 1
+#define BUDGETED 0
+#define COUNT_FUSION 0
+#include "um_threaded_engine.h"
+#undef THREADED_ENGINE
+#undef PUBLISH_PC
+#undef BUDGETED
+#undef COUNT_FUSION
+
+#define THREADED_ENGINE threaded_budgeted
+#define PUBLISH_PC 0
+#define BUDGETED 1
+#define COUNT_FUSION 0
+#include "um_threaded_engine.h"
+#undef THREADED_ENGINE
+#undef PUBLISH_PC
+#undef BUDGETED
+#undef COUNT_FUSION
+
+#define THREADED_ENGINE threaded_fusion
+#define PUBLISH_PC 0
+#define BUDGETED 0
+#define COUNT_FUSION 1
+#include "um_threaded_engine.h"
+
+void run_threaded(umStorage *mem)
+{
+    threaded(mem, NULL, NULL);
+}
+
+void run_threaded_profiled(umStorage *mem)
+{
+    threaded_profiled(mem, NULL, NULL);
+}
+
+bool run_threaded_budgeted(umStorage *mem, uint64_t *budget)
+{
+    return threaded_budgeted(mem, budget, NULL);
+}
+
+void run_threaded_fusion(umStorage *mem, umFusion *fusion)
+{
+    threaded_fusion(mem, NULL, fusion);
+}
\ No newline at end of file
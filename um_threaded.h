@@ -0,0 +1,44 @@
+/**
+ ** um_threaded.h
+ ** Purpose: Interface for the threaded (computed goto) execution engine
+ **/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "um_mem.h"
+#include "um_stats.h"
+
+#ifndef UM_THREADED_H
+#define UM_THREADED_H
+
+/* Takes in a pointer to the um's memory with segment 0 loaded. Function
+ * executes the decoded records of segment 0 starting at the program counter
+ * until halt, using a table of handler labels indexed by op code. Each
+ * handler ends with its own fetch and decode of the next instruction, so the
+ * host branch predictor sees one indirect jump per op code rather than one
+ * shared jump.
+ */
+void run_threaded(umStorage *mem);
+
+/* Same as run_threaded, but stores the program and pc of every
+ * instruction in mem->executing before running it, so the sampling
+ * profiler and the tracer see where the program is.
+ */
+void run_threaded_profiled(umStorage *mem);
+
+/* Takes in a pointer to the um's memory and to a number of instructions.
+ * Function runs like run_threaded, but stops before the next instruction
+ * once that many have run, leaving the program counter on it so a later
+ * call carries on. The instructions not used are left in *budget, which
+ * is kept current as they run, so that after a um failure it still tells
+ * how many ran (the failing one included). Returns true if the program
+ * halted and false if the budget ran out.
+ */
+bool run_threaded_budgeted(umStorage *mem, uint64_t *budget);
+
+/* Same as run_threaded, but counts in *fusion the dispatches made and the
+ * fused instruction pairs run, for um --fusion.
+ */
+void run_threaded_fusion(umStorage *mem, umFusion *fusion);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,144 @@
+/**
+ ** um_threaded_engine.h
+ ** Purpose: Body of the threaded execution engine. um_threaded.c includes
+ ** it once for each variant, with THREADED_ENGINE naming the function,
+ ** PUBLISH_PC set to 1 when the program and pc being run must be kept in
+ ** memory for the profiler and tracer,
+ ** BUDGETED set to 1 when the engine stops after the number of instructions
+ ** in *budget, and COUNT_FUSION set to 1 when it counts dispatches and
+ ** fused pairs in *fusion. Not for use elsewhere.
+ **/
+
+static bool THREADED_ENGINE(umStorage *mem, uint64_t *budget,
+                            umFusion *fusion)
+{
+    static void *const dispatch[UM_OP_COUNT] = {
+        &&op_cmove, &&op_segload, &&op_segstore, &&op_add,
+        &&op_multiply, &&op_divide, &&op_nand, &&op_halt,
+        &&op_map, &&op_unmap, &&op_output, &&op_input,
+        &&op_loadprogram, &&op_loadval, &&op_unknown, &&op_unknown,
+        &&op_undecoded, &&op_past_end,
+        &&op_loadval_add, &&op_loadval_segload, &&op_loadval_jump,
+        &&op_nand_nand, &&op_cmove_jump
+    };
+    uint32_t *r = mem->registers;
+    Decoded *code = mem->decoded;
+    uint32_t pc = mem->counter;
+    uint64_t program = PUBLISH_PC ? (uint64_t)mem->programID << 32 : 0;
+    Decoded *d;
+    (void)program;
+    (void)fusion;
+
+    DISPATCH();
+
+op_cmove:
+    if (r[d->c] != 0) {
+        r[d->a] = r[d->b];
+    }
+    DISPATCH();
+op_segload: {
+    Segment *seg = get_segment(mem, r[d->b]);
+    um_check(r[d->c] < seg->length, "segment load out of bounds");
+    r[d->a] = seg->words[r[d->c]];
+    DISPATCH();
+}
+op_segstore:
+    /* a store into a shared segment 0 copies it and its decoded records */
+    segStore(mem, d->a, d->b, d->c);
+    code = mem->decoded;
+    DISPATCH();
+op_add:
+    r[d->a] = r[d->b] + r[d->c];
+    DISPATCH();
+op_multiply:
+    r[d->a] = r[d->b] * r[d->c];
+    DISPATCH();
+op_divide:
+    um_check(r[d->c] != 0, "division by zero");
+    r[d->a] = r[d->b] / r[d->c];
+    DISPATCH();
+op_nand:
+    r[d->a] = ~(r[d->b] & r[d->c]);
+    DISPATCH();
+op_map:
+    mapSegment(mem, d->b, d->c);
+    DISPATCH();
+op_unmap:
+    unmapSegment(mem, d->c);
+    DISPATCH();
+op_output:
+    output(mem, d->c);
+    DISPATCH();
+op_input:
+    input(mem, d->c);
+    DISPATCH();
+op_loadprogram:
+    /* a jump within segment 0 needs none of loadProgram's work */
+    if (r[d->b] == 0 && r[d->c] < mem->programLength && !snapshot_requested) {
+        pc = r[d->c];
+        DISPATCH();
+    }
+    /* may replace segment 0 and its decoded records */
+    loadProgram(mem, d->b, d->c);
+    if (snapshot_requested) {
+        snapshot_take(mem);
+    }
+    code = mem->decoded;
+    pc = mem->counter;
+    if (PUBLISH_PC) {
+        program = (uint64_t)mem->programID << 32;
+    }
+    DISPATCH();
+op_loadval:
+    r[d->a] = d->value;
+    DISPATCH();
+op_undecoded:
+    /* decodes the record in place and runs it without dispatching again */
+    decode_fused(mem, pc - 1);
+    goto *dispatch[d->op];
+
+    /* Each fused handler runs the instruction of its own record, then steps
+     * onto the record of the second instruction and runs that from its
+     * operands, so a pair costs one dispatch.
+     */
+op_loadval_add:
+    r[d->a] = d->value;
+    FUSED_NEXT();
+    r[d->a] = r[d->b] + r[d->c];
+    DISPATCH();
+op_loadval_segload: {
+    r[d->a] = d->value;
+    FUSED_NEXT();
+    Segment *seg = get_segment(mem, r[d->b]);
+    um_check(r[d->c] < seg->length, "segment load out of bounds");
+    r[d->a] = seg->words[r[d->c]];
+    DISPATCH();
+}
+op_loadval_jump:
+    r[d->a] = d->value;
+    FUSED_NEXT();
+    goto op_loadprogram;
+op_nand_nand:
+    r[d->a] = ~(r[d->b] & r[d->c]);
+    FUSED_NEXT();
+    r[d->a] = ~(r[d->b] & r[d->c]);
+    DISPATCH();
+op_cmove_jump:
+    if (r[d->c] != 0) {
+        r[d->a] = r[d->b];
+    }
+    FUSED_NEXT();
+    goto op_loadprogram;
+op_halt:
+    mem->counter = pc;
+    return true;
+op_unknown:
+    mem->counter = pc;
+    fprintf(stderr, "Unkown Command\n");
+    return true;
+out_of_budget:
+    mem->counter = pc;
+    return false;
+op_past_end:
+    um_fail("program counter ran off the end of segment 0");
+}
\ No newline at end of file
@@ -0,0 +1,477 @@
+/**
+ ** um_trace.c
+ ** Purpose: Implementation of trace recording and replay. A trace file is
+ ** a header identifying the program (its length and a hash of its words)
+ ** followed by one record per event. A record starts with a varint holding
+ ** the kind of event in its low 3 bits (the op code of the instruction less
+ ** 7, or TRACE_INPUT_ENDED for an input that found the input ended) and
+ ** above them the distance of its program counter from that of the record
+ ** before, zigzag encoded so nearby counters cost little. A map or unmap
+ ** adds the distance of its identifier from the identifier of the last map
+ ** or unmap as another zigzag varint, and an input adds the byte read. Most
+ ** records take two or three bytes.
+ **
+ ** The machine encodes records into one of a ring of chunks. A full chunk
+ ** is handed to the writer thread and the machine carries on in the next,
+ ** only waiting when every chunk is still queued for writing.
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "um_trace.h"
+#include "um_load.h"
+
+#define TRACE_MAGIC "UMTRACE"
+#define TRACE_VERSION 1
+
+/* kinds of event */
+#define TRACE_HALT 0
+#define TRACE_MAP 1
+#define TRACE_UNMAP 2
+#define TRACE_INPUT 4
+#define TRACE_INPUT_ENDED 7
+#define TRACE_KIND_BITS 3
+
+#define TRACE_CHUNK_BYTES (1 << 16)
+#define TRACE_CHUNKS 4
+
+/* the most a record can take: a 10 byte varint, a 5 byte one and a byte */
+#define TRACE_RECORD_BYTES 16
+
+typedef struct TraceHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;            /* sizeof(TraceHeader) */
+    uint32_t programLength;         /* words of segment 0 at the start */
+    uint32_t counter;               /* program counter at the start */
+    uint64_t programHash;           /* of the words of segment 0 */
+} TraceHeader;
+
+struct umTrace {
+    bool replaying;
+    uint64_t events;
+    uint32_t lastCounter;
+    uint32_t lastIdentifier;
+
+    /* recording: the machine fills chunks[head], the writer writes out
+     * chunks[tail], and queued chunks are waiting to be written
+     */
+    int fd;
+    uint8_t *chunks[TRACE_CHUNKS];
+    size_t lengths[TRACE_CHUNKS];
+    size_t used;
+    int head;
+    int tail;
+    int queued;
+    bool closing;
+    bool failed;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    pthread_t writer;
+
+    /* replaying: the whole trace, and the next record in it */
+    uint8_t *bytes;
+    size_t size;
+    size_t next;
+};
+
+/* FNV-1a over the words of segment 0 */
+static uint64_t hash_program(umStorage *mem)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (uint32_t i = 0; i < mem->programLength; i++) {
+        uint32_t word = mem->program[i];
+        for (int byte = 0; byte < 4; byte++) {
+            hash = (hash ^ ((word >> (8 * byte)) & 0xff)) * 1099511628211ULL;
+        }
+    }
+    return hash;
+}
+
+static uint32_t zigzag(uint32_t from, uint32_t to)
+{
+    int32_t distance = (int32_t)(to - from);
+    return ((uint32_t)distance << 1) ^ (uint32_t)(distance >> 31);
+}
+
+static uint32_t unzigzag(uint32_t from, uint32_t code)
+{
+    return from + ((code >> 1) ^ -(code & 1));
+}
+
+static void *write_chunks(void *argument)
+{
+    umTrace *trace = argument;
+    pthread_mutex_lock(&trace->lock);
+    for (;;) {
+        while (trace->queued == 0 && !trace->closing) {
+            pthread_cond_wait(&trace->changed, &trace->lock);
+        }
+        if (trace->queued == 0) {
+            break;
+        }
+        int chunk = trace->tail;
+        pthread_mutex_unlock(&trace->lock);
+
+        /* the chunk stays queued while it is written, so it is not reused */
+        const uint8_t *bytes = trace->chunks[chunk];
+        size_t left = trace->lengths[chunk];
+        bool failed = false;
+        while (left > 0 && !failed) {
+            ssize_t written = write(trace->fd, bytes, left);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            failed = written <= 0;
+            if (!failed) {
+                bytes += written;
+                left -= written;
+            }
+        }
+
+        pthread_mutex_lock(&trace->lock);
+        trace->failed = trace->failed || failed;
+        trace->tail = (trace->tail + 1) % TRACE_CHUNKS;
+        trace->queued--;
+        pthread_cond_broadcast(&trace->changed);
+    }
+    pthread_mutex_unlock(&trace->lock);
+    return NULL;
+}
+
+/* hands the chunk being filled to the writer and moves on to the next */
+static void submit_chunk(umTrace *trace)
+{
+    pthread_mutex_lock(&trace->lock);
+    trace->lengths[trace->head] = trace->used;
+    trace->head = (trace->head + 1) % TRACE_CHUNKS;
+    trace->queued++;
+    pthread_cond_broadcast(&trace->changed);
+    while (trace->queued == TRACE_CHUNKS) {
+        pthread_cond_wait(&trace->changed, &trace->lock);
+    }
+    pthread_mutex_unlock(&trace->lock);
+    trace->used = 0;
+}
+
+static uint8_t *put_varint(uint8_t *out, uint64_t value)
+{
+    while (value >= 0x80) {
+        *out++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (uint8_t)value;
+    return out;
+}
+
+/* returns the pc of the instruction the machine is running */
+static uint32_t running_pc(const umStorage *mem)
+{
+    return (uint32_t)mem->executing;
+}
+
+/* Takes in a recording trace, the machine and the kind of an event.
+ * Function encodes the event's record at the end of the chunk being
+ * filled. The identifier is encoded for a map or unmap, and the byte for
+ * an input.
+ */
+static void put_record(umTrace *trace, umStorage *mem, int kind,
+                       uint32_t value)
+{
+    if (trace->used + TRACE_RECORD_BYTES > TRACE_CHUNK_BYTES) {
+        submit_chunk(trace);
+    }
+    uint8_t *start = trace->chunks[trace->head] + trace->used;
+    uint8_t *out = start;
+    uint32_t counter = running_pc(mem);
+
+    uint64_t head = zigzag(trace->lastCounter, counter);
+    out = put_varint(out, head << TRACE_KIND_BITS | kind);
+    trace->lastCounter = counter;
+    if (kind == TRACE_MAP || kind == TRACE_UNMAP) {
+        out = put_varint(out, zigzag(trace->lastIdentifier, value));
+        trace->lastIdentifier = value;
+    } else if (kind == TRACE_INPUT) {
+        *out++ = (uint8_t)value;
+    }
+    trace->used += out - start;
+    trace->events++;
+}
+
+umTrace *trace_record(umStorage *mem, const char *path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "um: cannot write %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    TraceHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    header.version = TRACE_VERSION;
+    header.headerSize = sizeof(header);
+    header.programLength = mem->programLength;
+    header.counter = mem->counter;
+    header.programHash = hash_program(mem);
+    if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+        fprintf(stderr, "um: cannot write %s: %s\n", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    umTrace *trace = calloc(1, sizeof(*trace));
+    assert(trace != NULL);
+    trace->fd = fd;
+    trace->lastCounter = mem->counter;
+    for (int i = 0; i < TRACE_CHUNKS; i++) {
+        trace->chunks[i] = malloc(TRACE_CHUNK_BYTES);
+        assert(trace->chunks[i] != NULL);
+    }
+    pthread_mutex_init(&trace->lock, NULL);
+    pthread_cond_init(&trace->changed, NULL);
+    int failed = pthread_create(&trace->writer, NULL, write_chunks, trace);
+    assert(failed == 0);
+
+    mem->trace = trace;
+    return trace;
+}
+
+static void corrupt(const char *path, const char *why)
+{
+    fprintf(stderr, "um: %s is not a usable trace: %s\n", path, why);
+    exit(EXIT_FAILURE);
+}
+
+umTrace *trace_replay(umStorage *mem, const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "um: cannot open %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    size_t size = 0;
+    uint8_t *bytes = read_all(fd, &size);
+    close(fd);
+    if (bytes == NULL) {
+        fprintf(stderr, "um: cannot read %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    TraceHeader header;
+    if (size < sizeof(header)) {
+        corrupt(path, "too short");
+    }
+    memcpy(&header, bytes, sizeof(header));
+    if (memcmp(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0
+        || header.headerSize != sizeof(header)) {
+        corrupt(path, "bad header");
+    }
+    if (header.version != TRACE_VERSION) {
+        corrupt(path, "unsupported version");
+    }
+    if (header.programLength != mem->programLength
+        || header.counter != mem->counter
+        || header.programHash != hash_program(mem)) {
+        corrupt(path, "recorded from another program");
+    }
+
+    umTrace *trace = calloc(1, sizeof(*trace));
+    assert(trace != NULL);
+    trace->replaying = true;
+    trace->fd = -1;
+    trace->lastCounter = mem->counter;
+    trace->bytes = bytes;
+    trace->size = size;
+    trace->next = sizeof(header);
+
+    mem->trace = trace;
+    return trace;
+}
+
+static const char *event_name(int kind)
+{
+    switch (kind) {
+    case TRACE_HALT:
+        return "halt";
+    case TRACE_MAP:
+        return "map";
+    case TRACE_UNMAP:
+        return "unmap";
+    case TRACE_INPUT:
+    case TRACE_INPUT_ENDED:
+        return "input";
+    }
+    return "a bad record";
+}
+
+/* Takes in a replaying trace, the kind of event the machine is running and
+ * a description of what the trace holds instead. Function reports where
+ * the replay left the recorded run and ends the program.
+ */
+static void diverged(umTrace *trace, umStorage *mem, int kind,
+                     const char *expected)
+{
+    static char failure[256];
+    snprintf(failure, sizeof(failure), "replay diverged at event %llu: ran "
+             "%s at pc %u, the trace has %s",
+             (unsigned long long)trace->events + 1, event_name(kind),
+             running_pc(mem), expected);
+    um_fail(failure);
+}
+
+static bool get_varint(umTrace *trace, uint64_t *value)
+{
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (trace->next == trace->size) {
+            return false;
+        }
+        uint8_t byte = trace->bytes[trace->next++];
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Takes in a replaying trace, the machine and the kind of event it is
+ * running. Function reads the next record, checks that it is the same
+ * event at the same program counter, and returns its identifier or input
+ * byte. The record of an input says in *ended whether the input had ended.
+ */
+static uint32_t get_record(umTrace *trace, umStorage *mem, int kind,
+                           bool *ended)
+{
+    char expected[96];
+    uint64_t code = 0;
+    if (trace->next == trace->size) {
+        diverged(trace, mem, kind, "ended");
+    }
+    if (!get_varint(trace, &code)) {
+        diverged(trace, mem, kind, "a truncated record");
+    }
+    int recorded = code & ((1 << TRACE_KIND_BITS) - 1);
+    if (recorded != kind
+        && !(kind == TRACE_INPUT && recorded == TRACE_INPUT_ENDED)) {
+        snprintf(expected, sizeof(expected), "%s", event_name(recorded));
+        diverged(trace, mem, kind, expected);
+    }
+    uint32_t counter = unzigzag(trace->lastCounter,
+                                (uint32_t)(code >> TRACE_KIND_BITS));
+    if (counter != running_pc(mem)) {
+        snprintf(expected, sizeof(expected), "%s at pc %u",
+                 event_name(recorded), counter);
+        diverged(trace, mem, kind, expected);
+    }
+    trace->lastCounter = counter;
+    trace->events++;
+
+    uint32_t value = 0;
+    if (kind == TRACE_MAP || kind == TRACE_UNMAP) {
+        if (!get_varint(trace, &code)) {
+            diverged(trace, mem, kind, "a truncated record");
+        }
+        value = unzigzag(trace->lastIdentifier, (uint32_t)code);
+        trace->lastIdentifier = value;
+    } else if (kind == TRACE_INPUT) {
+        *ended = recorded == TRACE_INPUT_ENDED;
+        if (!*ended) {
+            if (trace->next == trace->size) {
+                diverged(trace, mem, kind, "a truncated record");
+            }
+            value = trace->bytes[trace->next++];
+        }
+    }
+    return value;
+}
+
+uint32_t trace_input(umTrace *trace, umStorage *mem)
+{
+    if (trace->replaying) {
+        bool ended = false;
+        uint32_t value = get_record(trace, mem, TRACE_INPUT, &ended);
+        return ended ? UINT32_MAX : value;
+    }
+    uint32_t value = io_get(mem->io);
+    if (value == UINT32_MAX) {
+        put_record(trace, mem, TRACE_INPUT_ENDED, 0);
+    } else {
+        put_record(trace, mem, TRACE_INPUT, value);
+    }
+    return value;
+}
+
+/* records an event with an identifier, or checks it on replay */
+static void identifier_event(umTrace *trace, umStorage *mem, int kind,
+                             uint32_t identifier)
+{
+    if (!trace->replaying) {
+        put_record(trace, mem, kind, identifier);
+        return;
+    }
+    uint32_t recorded = get_record(trace, mem, kind, NULL);
+    if (recorded != identifier) {
+        char expected[96];
+        snprintf(expected, sizeof(expected), "%s of segment %u, not %u",
+                 event_name(kind), recorded, identifier);
+        diverged(trace, mem, kind, expected);
+    }
+}
+
+void trace_map(umTrace *trace, umStorage *mem, uint32_t identifier)
+{
+    identifier_event(trace, mem, TRACE_MAP, identifier);
+}
+
+void trace_unmap(umTrace *trace, umStorage *mem, uint32_t identifier)
+{
+    identifier_event(trace, mem, TRACE_UNMAP, identifier);
+}
+
+bool trace_close(umTrace *trace, umStorage *mem, bool halted)
+{
+    bool ok = true;
+    mem->trace = NULL;
+    if (trace->replaying) {
+        if (halted) {
+            get_record(trace, mem, TRACE_HALT, NULL);
+            ok = trace->next == trace->size;
+            if (!ok) {
+                fprintf(stderr, "um: replay halted before the end of the "
+                                "trace\n");
+            }
+        }
+        free(trace->bytes);
+        free(trace);
+        return ok;
+    }
+
+    if (halted) {
+        put_record(trace, mem, TRACE_HALT, 0);
+    }
+    pthread_mutex_lock(&trace->lock);
+    trace->lengths[trace->head] = trace->used;
+    trace->queued++;
+    trace->closing = true;
+    pthread_cond_broadcast(&trace->changed);
+    pthread_mutex_unlock(&trace->lock);
+    pthread_join(trace->writer, NULL);
+
+    ok = !trace->failed && close(trace->fd) == 0;
+    if (!ok) {
+        fprintf(stderr, "um: cannot write the trace\n");
+    }
+    pthread_mutex_destroy(&trace->lock);
+    pthread_cond_destroy(&trace->changed);
+    for (int i = 0; i < TRACE_CHUNKS; i++) {
+        free(trace->chunks[i]);
+    }
+    free(trace);
+    return ok;
+}
\ No newline at end of file
@@ -0,0 +1,66 @@
+/**
+ ** um_trace.h
+ ** Purpose: Interface for recording a run to a binary trace and replaying
+ ** it. A run of the um depends only on its program and its input, so a
+ ** trace holds the input the program read along with the events that show
+ ** where it was (each input, map, unmap and the halt, with its program
+ ** counter and result), and a replay feeds that input back and checks that
+ ** every event happens again at the same place.
+ **/
+
+#include <stdbool.h>
+#include "um_mem.h"
+
+#ifndef UM_TRACE_H
+#define UM_TRACE_H
+
+/* A trace being recorded or replayed; only handled through the functions
+ * below. The machine it is attached to (mem->trace) calls trace_input,
+ * trace_map and trace_unmap from its input, map and unmap instructions,
+ * with the instruction that runs published in mem->executing.
+ */
+typedef struct umTrace umTrace;
+
+/* Takes in a pointer to the um's memory with segment 0 loaded and the name
+ * of a file. Function starts recording the run into the file and attaches
+ * the trace to the machine. Events are encoded into buffers that a thread
+ * of the trace's own writes out, so recording costs the machine little
+ * more than the encoding. Returns NULL if the file cannot be written.
+ */
+umTrace *trace_record(umStorage *mem, const char *path);
+
+/* Takes in a pointer to the um's memory with segment 0 loaded and the name
+ * of a trace file. Function attaches the trace to the machine, which then
+ * takes its input from the trace rather than from its io. A file that is
+ * not a trace of the same program is reported on stderr and ends the
+ * program with EXIT_FAILURE.
+ */
+umTrace *trace_replay(umStorage *mem, const char *path);
+
+/* Takes in a trace and the machine running an input instruction. Function
+ * returns the input, as io_get does: read from the machine's io and
+ * recorded, or taken from the trace on replay.
+ */
+uint32_t trace_input(umTrace *trace, umStorage *mem);
+
+/* Takes in a trace, the machine and the identifier a map instruction has
+ * just mapped. Function records the event, or on replay checks it against
+ * the trace.
+ */
+void trace_map(umTrace *trace, umStorage *mem, uint32_t identifier);
+
+/* Takes in a trace, the machine and the identifier an unmap instruction is
+ * about to unmap. Function records the event, or on replay checks it
+ * against the trace.
+ */
+void trace_unmap(umTrace *trace, umStorage *mem, uint32_t identifier);
+
+/* Takes in a trace, the machine it is attached to and whether the program
+ * halted (rather than failed). Function records the halt, writes out
+ * everything buffered and closes the file; on replay it checks that the
+ * trace ends with the same halt. The trace is detached and freed. Returns
+ * false if the trace could not be written or the replay did not match.
+ */
+bool trace_close(umTrace *trace, umStorage *mem, bool halted);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,387 @@
+/**
+ ** umbench.c
+ ** Purpose: Benchmark driver for the um. Runs each program several times in
+ ** a child process, checks its output against the expected output, and
+ ** writes wall time, instructions executed, MIPS and peak RSS as one tab
+ ** separated line per program. A results file saved from an earlier run can
+ ** be given as a baseline, and each program's median time is compared with
+ ** it.
+ **
+ ** A program "name.ext" is fed "name.0" on standard input when that file
+ ** exists, and its output must match "name.1", or "name.out" when there is
+ ** no "name.1" (the writetests and sandmark conventions). With neither file
+ ** the program must print nothing.
+ **/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+typedef struct Options {
+    const char *um;           /* path of the um binary */
+    const char *engine;       /* passed as --engine, NULL for the default */
+    int runs;
+    const char *output;       /* results file */
+    const char *baseline;     /* results file to compare with, or NULL */
+    double threshold;         /* slowdown in percent counted as regression */
+} Options;
+
+typedef struct Result {
+    const char *program;
+    unsigned long long instructions;    /* 0 when the count run failed */
+    double wallMin;
+    double wallMedian;
+    long maxRss;                        /* kilobytes, largest of all runs */
+    const char *status;
+} Result;
+
+/* slowdowns smaller than this many seconds are treated as noise */
+static const double NOISE_SECONDS = 0.01;
+
+static char outPath[] = "/tmp/umbench-out-XXXXXX";
+static char errPath[] = "/tmp/umbench-err-XXXXXX";
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Usage:     umbench [-u um] [-e engine] [-n runs] "
+            "[-o results] [-b baseline] [-t percent] program...\n");
+    exit(EXIT_FAILURE);
+}
+
+/* Takes in a file name and an extension. Function returns a new string
+ * holding the name with its own extension replaced by the given one.
+ */
+static char *sibling(const char *program, const char *extension)
+{
+    const char *slash = strrchr(program, '/');
+    const char *dot = strrchr(program, '.');
+    size_t stem = strlen(program);
+    if (dot != NULL && (slash == NULL || dot > slash)) {
+        stem = (size_t)(dot - program);
+    }
+    char *name = malloc(stem + strlen(extension) + 1);
+    assert(name);
+    memcpy(name, program, stem);
+    strcpy(name + stem, extension);
+    return name;
+}
+
+static bool exists(const char *path)
+{
+    return access(path, R_OK) == 0;
+}
+
+static int redirect(const char *path, int flags, int target)
+{
+    int fd = open(path, flags, 0644);
+    if (fd < 0 || dup2(fd, target) < 0) {
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+/* Takes in the options, a program, its input file (or NULL) and whether the
+ * instructions should be counted. Function runs the um once with output and
+ * errors sent to the scratch files, stores the wall time and peak RSS of
+ * the child, and returns its wait status.
+ */
+static int run_once(const Options *options, const char *program,
+                    const char *input, bool count, double *wall, long *rss)
+{
+    char engine[64];
+    const char *argv[5];
+    int argc = 0;
+    argv[argc++] = options->um;
+    if (options->engine != NULL) {
+        snprintf(engine, sizeof(engine), "--engine=%s", options->engine);
+        argv[argc++] = engine;
+    }
+    if (count) {
+        argv[argc++] = "--count";
+    }
+    argv[argc++] = program;
+    argv[argc] = NULL;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t child = fork();
+    if (child < 0) {
+        perror("umbench: fork");
+        exit(EXIT_FAILURE);
+    }
+    if (child == 0) {
+        if (redirect(input != NULL ? input : "/dev/null", O_RDONLY, 0) != 0
+            || redirect(outPath, O_WRONLY | O_TRUNC, 1) != 0
+            || redirect(errPath, O_WRONLY | O_TRUNC, 2) != 0) {
+            _exit(127);
+        }
+        execv(options->um, (char *const *)argv);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    while (wait4(child, &status, 0, &usage) < 0) {
+        if (errno != EINTR) {
+            perror("umbench: wait4");
+            exit(EXIT_FAILURE);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    *wall = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    *rss = usage.ru_maxrss;
+    return status;
+}
+
+/* Function returns true if the two files hold the same bytes */
+static bool same_contents(const char *first, const char *second)
+{
+    FILE *a = fopen(first, "rb");
+    FILE *b = fopen(second, "rb");
+    bool same = a != NULL && b != NULL;
+    while (same) {
+        int x = getc(a);
+        int y = getc(b);
+        same = x == y;
+        if (x == EOF || y == EOF) {
+            break;
+        }
+    }
+    if (a != NULL) {
+        fclose(a);
+    }
+    if (b != NULL) {
+        fclose(b);
+    }
+    return same;
+}
+
+/* Function returns true if the last run's output matches the expected
+ * file, or is empty when there is no expected file
+ */
+static bool matches_expected(const char *expected)
+{
+    if (exists(expected)) {
+        return same_contents(outPath, expected);
+    }
+    FILE *fp = fopen(outPath, "rb");
+    bool empty = fp != NULL && getc(fp) == EOF;
+    if (fp != NULL) {
+        fclose(fp);
+    }
+    return empty;
+}
+
+/* reads the count printed by um --count from the error file */
+static unsigned long long read_count(void)
+{
+    FILE *fp = fopen(errPath, "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    char line[256];
+    unsigned long long count = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (strncmp(line, "instructions: ", 14) == 0) {
+            count = strtoull(line + 14, NULL, 10);
+        }
+    }
+    fclose(fp);
+    return count;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static Result bench_program(const Options *options, const char *program)
+{
+    Result result = { program, 0, 0.0, 0.0, 0, "ok" };
+    char *input = sibling(program, ".0");
+    char *expected = sibling(program, ".1");
+    if (!exists(expected)) {
+        free(expected);
+        expected = sibling(program, ".out");
+    }
+    if (!exists(input)) {
+        free(input);
+        input = NULL;
+    }
+
+    double wall;
+    long rss;
+    int status = run_once(options, program, input, true, &wall, &rss);
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        result.instructions = read_count();
+    }
+
+    double *walls = malloc(options->runs * sizeof(*walls));
+    assert(walls);
+    for (int i = 0; i < options->runs; i++) {
+        status = run_once(options, program, input, false, &walls[i], &rss);
+        if (rss > result.maxRss) {
+            result.maxRss = rss;
+        }
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            result.status = "crashed";
+        } else if (!matches_expected(expected)
+                   && strcmp(result.status, "ok") == 0) {
+            result.status = "wrong-output";
+        }
+    }
+    qsort(walls, options->runs, sizeof(*walls), compare_doubles);
+    result.wallMin = walls[0];
+    result.wallMedian = (options->runs % 2 == 1)
+        ? walls[options->runs / 2]
+        : (walls[options->runs / 2 - 1] + walls[options->runs / 2]) / 2;
+
+    free(walls);
+    free(input);
+    free(expected);
+    return result;
+}
+
+static double mips(const Result *result)
+{
+    if (result->instructions == 0 || result->wallMedian <= 0) {
+        return 0.0;
+    }
+    return result->instructions / result->wallMedian / 1e6;
+}
+
+static void write_results(const Options *options, Result *results, int count)
+{
+    FILE *fp = fopen(options->output, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "umbench: cannot write %s: %s\n", options->output,
+                strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    fprintf(fp, "program\tengine\truns\tinstructions\twall_min_s\t"
+                "wall_median_s\tmips\tmax_rss_kb\tstatus\n");
+    for (int i = 0; i < count; i++) {
+        Result *r = &results[i];
+        fprintf(fp, "%s\t%s\t%d\t%llu\t%.6f\t%.6f\t%.3f\t%ld\t%s\n",
+                r->program, options->engine ? options->engine : "default",
+                options->runs, r->instructions, r->wallMin, r->wallMedian,
+                mips(r), r->maxRss, r->status);
+    }
+    fclose(fp);
+}
+
+/* Takes in the results of this run. Function reads the baseline results
+ * file and prints the change in median time of every program found in
+ * both. Returns the number of programs that got slower by more than the
+ * threshold.
+ */
+static int compare_baseline(const Options *options, Result *results,
+                            int count)
+{
+    FILE *fp = fopen(options->baseline, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "umbench: cannot read %s: %s\n", options->baseline,
+                strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    int regressions = 0;
+    char line[4096];
+    printf("\ncompared with %s:\n", options->baseline);
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char program[2048];
+        double median;
+        if (sscanf(line, "%2047[^\t]\t%*[^\t]\t%*d\t%*u\t%*f\t%lf",
+                   program, &median) != 2) {
+            continue;   /* the header or a malformed line */
+        }
+        for (int i = 0; i < count; i++) {
+            if (strcmp(results[i].program, program) != 0) {
+                continue;
+            }
+            double now = results[i].wallMedian;
+            double change = median > 0 ? (now - median) / median * 100 : 0;
+            bool slower = change > options->threshold
+                          && now - median > NOISE_SECONDS;
+            printf("%-28s %10.4fs -> %10.4fs %+7.1f%%%s\n", program, median,
+                   now, change, slower ? "  REGRESSION" : "");
+            regressions += slower;
+        }
+    }
+    fclose(fp);
+    return regressions;
+}
+
+int main(int argc, char *argv[])
+{
+    Options options = { "./um", NULL, 3, "bench.tsv", NULL, 5.0 };
+    int opt;
+    while ((opt = getopt(argc, argv, "u:e:n:o:b:t:")) != -1) {
+        switch (opt) {
+        case 'u': options.um = optarg;                 break;
+        case 'e': options.engine = optarg;             break;
+        case 'n': options.runs = atoi(optarg);         break;
+        case 'o': options.output = optarg;             break;
+        case 'b': options.baseline = optarg;           break;
+        case 't': options.threshold = atof(optarg);    break;
+        default:  usage();
+        }
+    }
+    if (optind == argc || options.runs < 1) {
+        usage();
+    }
+
+    int fd = mkstemp(outPath);
+    assert(fd >= 0);
+    close(fd);
+    fd = mkstemp(errPath);
+    assert(fd >= 0);
+    close(fd);
+
+    int count = argc - optind;
+    Result *results = malloc(count * sizeof(*results));
+    assert(results);
+    int failures = 0;
+    printf("%-28s %14s %10s %10s %10s  %s\n", "program", "instructions",
+           "median s", "MIPS", "RSS kB", "status");
+    for (int i = 0; i < count; i++) {
+        results[i] = bench_program(&options, argv[optind + i]);
+        Result *r = &results[i];
+        printf("%-28s %14llu %10.4f %10.2f %10ld  %s\n", r->program,
+               r->instructions, r->wallMedian, mips(r), r->maxRss, r->status);
+        fflush(stdout);
+        failures += strcmp(r->status, "ok") != 0;
+    }
+    unlink(outPath);
+    unlink(errPath);
+
+    write_results(&options, results, count);
+    int regressions = 0;
+    if (options.baseline != NULL) {
+        regressions = compare_baseline(&options, results, count);
+    }
+    free(results);
+
+    if (failures > 0) {
+        fprintf(stderr, "umbench: %d program(s) failed\n", failures);
+    }
+    if (regressions > 0) {
+        fprintf(stderr, "umbench: %d program(s) regressed by more than "
+                        "%.1f%%\n", regressions, options.threshold);
+    }
+    return failures > 0 || regressions > 0;
+}
\ No newline at end of file
@@ -0,0 +1,426 @@
+/**
+ ** umdump.c
+ ** Purpose: Disassembler for um program images. Prints every word of
+ ** segment 0 as an instruction, split into basic blocks. A block starts at
+ ** the entry point, after a halt or loadProgram, and at every loadProgram
+ ** target found. Targets are found by following, through each block, the
+ ** values loadval puts in registers (a cMove of two known values may leave
+ ** either, so a conditional jump shows both targets). A profile written by
+ ** 'um --profile-out' (or any "program pc count" table) can be overlaid, and
+ ** the blocks then carry their share of the samples.
+ **/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include "um_disasm.h"
+#include "um_load.h"
+#include "um_snapshot.h"
+
+/* values a register may hold at a point of the program: count of them, or
+ * 0 when it is not known
+ */
+typedef struct Known {
+    int count;
+    uint32_t values[2];
+} Known;
+
+/* what the loadProgram at a pc does */
+enum {
+    JUMP_NONE = 0,                  /* not a loadProgram */
+    JUMP_KNOWN,                     /* jumps to the targets found */
+    JUMP_UNKNOWN,                   /* target (or segment loaded) unknown */
+    JUMP_LOAD                       /* loads another segment */
+};
+
+typedef struct Program {
+    const uint32_t *words;
+    uint32_t length;
+    uint32_t entry;                 /* program counter the run starts at */
+    bool *leader;                   /* starts a block */
+    uint8_t *jump;                  /* JUMP_ kind of each pc */
+    uint32_t (*targets)[2];         /* of each JUMP_KNOWN pc */
+    uint8_t *targetCount;
+    uint32_t *fromIndex;            /* jumps to pc are from[fromIndex[pc]] */
+    uint32_t *from;                 /* up to from[fromIndex[pc + 1]] */
+    uint64_t *samples;              /* of each pc, NULL without a profile */
+    uint64_t totalSamples;
+} Program;
+
+typedef struct Block {
+    uint32_t start;
+    uint32_t end;                   /* one past the last word */
+    uint64_t samples;
+} Block;
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Usage:     umdump [-p profile] [-i program] [-n blocks] "
+            "(program.um | -s snapshot)\n");
+    exit(EXIT_FAILURE);
+}
+
+static Known unknown(void)
+{
+    Known k = { 0, { 0, 0 } };
+    return k;
+}
+
+static Known constant(uint32_t value)
+{
+    Known k = { 1, { value, 0 } };
+    return k;
+}
+
+/* the values either of two registers may hold, or unknown if too many */
+static Known either(Known x, Known y)
+{
+    if (x.count == 0 || y.count == 0) {
+        return unknown();
+    }
+    Known k = x;
+    for (int i = 0; i < y.count; i++) {
+        bool seen = false;
+        for (int j = 0; j < k.count; j++) {
+            seen = seen || k.values[j] == y.values[i];
+        }
+        if (!seen) {
+            if (k.count == 2) {
+                return unknown();
+            }
+            k.values[k.count++] = y.values[i];
+        }
+    }
+    return k;
+}
+
+/* Takes in an instruction word and the registers before it. Function
+ * updates the registers to what is known of them after it.
+ */
+static void step(uint32_t word, Known *r)
+{
+    unsigned op = word >> 28;
+    unsigned a = (word >> 6) & 7;
+    unsigned b = (word >> 3) & 7;
+    unsigned c = word & 7;
+    bool single = r[b].count == 1 && r[c].count == 1;
+    uint32_t x = r[b].values[0];
+    uint32_t y = r[c].values[0];
+
+    switch (op) {
+    case 0:
+        if (r[c].count != 1) {
+            r[a] = either(r[a], r[b]);
+        } else if (y != 0) {
+            r[a] = r[b];
+        }
+        break;
+    case 1:
+        r[a] = unknown();
+        break;
+    case 3:
+        r[a] = single ? constant(x + y) : unknown();
+        break;
+    case 4:
+        r[a] = single ? constant(x * y) : unknown();
+        break;
+    case 5:
+        r[a] = single && y != 0 ? constant(x / y) : unknown();
+        break;
+    case 6:
+        r[a] = single ? constant(~(x & y)) : unknown();
+        break;
+    case 8:
+        r[b] = unknown();
+        break;
+    case 11:
+        r[c] = unknown();
+        break;
+    case 13:
+        r[(word >> 25) & 7] = constant(word & 0x1ffffff);
+        break;
+    }
+}
+
+/* Takes in the program and a pc holding a loadProgram with the registers
+ * before it. Function records where it jumps.
+ */
+static void find_targets(Program *p, uint32_t pc, const Known *r)
+{
+    unsigned b = (p->words[pc] >> 3) & 7;
+    unsigned c = p->words[pc] & 7;
+    p->targetCount[pc] = 0;
+    if (r[b].count == 1 && r[b].values[0] != 0) {
+        p->jump[pc] = JUMP_LOAD;
+        return;
+    }
+    if (r[b].count != 1 || r[c].count == 0) {
+        p->jump[pc] = JUMP_UNKNOWN;
+        return;
+    }
+    p->jump[pc] = JUMP_KNOWN;
+    for (int i = 0; i < r[c].count; i++) {
+        p->targets[pc][p->targetCount[pc]++] = r[c].values[i];
+    }
+}
+
+/* Takes in the program with its leaders so far. Function follows the
+ * registers through every block, starting each block with nothing known,
+ * and records the targets of every loadProgram. Returns true if a target
+ * that is not yet a leader was found, and makes it one.
+ */
+static bool scan(Program *p)
+{
+    Known r[8];
+    bool grew = false;
+    for (uint32_t pc = 0; pc < p->length; pc++) {
+        if (p->leader[pc]) {
+            for (int i = 0; i < 8; i++) {
+                r[i] = unknown();
+            }
+        }
+        uint32_t word = p->words[pc];
+        unsigned op = word >> 28;
+        if (op == 12) {
+            find_targets(p, pc, r);
+        }
+        step(word, r);
+        if ((op == 7 || op == 12) && pc + 1 < p->length) {
+            p->leader[pc + 1] = true;
+        }
+    }
+    for (uint32_t pc = 0; pc < p->length; pc++) {
+        for (int i = 0; i < p->targetCount[pc]; i++) {
+            uint32_t target = p->targets[pc][i];
+            if (target < p->length && !p->leader[target]) {
+                p->leader[target] = true;
+                grew = true;
+            }
+        }
+    }
+    return grew;
+}
+
+static void find_blocks(Program *p)
+{
+    p->leader = calloc(p->length + 1, sizeof(*p->leader));
+    p->jump = calloc(p->length + 1, sizeof(*p->jump));
+    p->targets = calloc(p->length + 1, sizeof(*p->targets));
+    p->targetCount = calloc(p->length + 1, sizeof(*p->targetCount));
+    assert(p->leader && p->jump && p->targets && p->targetCount);
+    if (p->length == 0) {
+        return;
+    }
+    p->leader[0] = true;
+    if (p->entry < p->length) {
+        p->leader[p->entry] = true;
+    }
+    /* each pass starts more blocks with nothing known, until none is new */
+    for (int pass = 0; pass < 8 && scan(p); pass++) {
+    }
+
+    /* lists the jumps to each target, counting them first */
+    p->fromIndex = calloc(p->length + 2, sizeof(*p->fromIndex));
+    assert(p->fromIndex != NULL);
+    for (uint32_t pc = 0; pc < p->length; pc++) {
+        for (int i = 0; i < p->targetCount[pc]; i++) {
+            if (p->targets[pc][i] < p->length) {
+                p->fromIndex[p->targets[pc][i] + 2]++;
+            }
+        }
+    }
+    for (uint32_t pc = 0; pc < p->length; pc++) {
+        p->fromIndex[pc + 2] += p->fromIndex[pc + 1];
+    }
+    p->from = malloc((p->fromIndex[p->length + 1] + 1) * sizeof(*p->from));
+    assert(p->from != NULL);
+    for (uint32_t pc = 0; pc < p->length; pc++) {
+        for (int i = 0; i < p->targetCount[pc]; i++) {
+            if (p->targets[pc][i] < p->length) {
+                p->from[p->fromIndex[p->targets[pc][i] + 1]++] = pc;
+            }
+        }
+    }
+}
+
+/* Takes in the program and a profile file. Function adds up the samples of
+ * every pc of the given program. Returns false if the file cannot be read.
+ */
+static bool read_profile(Program *p, const char *path, uint32_t program)
+{
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return false;
+    }
+    p->samples = calloc(p->length + 1, sizeof(*p->samples));
+    assert(p->samples != NULL);
+    char line[256];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        unsigned id, pc;
+        unsigned long long count;
+        /* the header line and anything else not numeric is skipped */
+        if (sscanf(line, "%u %u %llu", &id, &pc, &count) != 3) {
+            continue;
+        }
+        if (id == program && pc < p->length) {
+            p->samples[pc] += count;
+            p->totalSamples += count;
+        }
+    }
+    fclose(fp);
+    return true;
+}
+
+static double share(const Program *p, uint64_t samples)
+{
+    return 100.0 * samples / (p->totalSamples ? p->totalSamples : 1);
+}
+
+/* Takes in the program and a block. Function prints the block's header,
+ * with the loadPrograms that jump to it, then its instructions.
+ */
+static void print_block(const Program *p, const Block *block)
+{
+    printf("\n; block %u, %u words", block->start, block->end - block->start);
+    if (block->start == p->entry) {
+        printf(", entry");
+    }
+    uint32_t first = p->fromIndex[block->start];
+    uint32_t from = p->fromIndex[block->start + 1] - first;
+    for (uint32_t i = 0; i < from && i < 8; i++) {
+        printf("%s%u", i == 0 ? ", from " : " ", p->from[first + i]);
+    }
+    if (from > 8) {
+        printf(" and %u more", from - 8);
+    }
+    if (p->samples != NULL) {
+        printf(", %llu samples (%.2f%%)", (unsigned long long)block->samples,
+               share(p, block->samples));
+    }
+    printf("\n");
+
+    for (uint32_t pc = block->start; pc < block->end; pc++) {
+        char text[64];
+        char jump[64] = "";
+        disassemble(p->words[pc], text, sizeof(text));
+        if (p->jump[pc] == JUMP_KNOWN) {
+            int used = snprintf(jump, sizeof(jump), "-> %u",
+                                p->targets[pc][0]);
+            if (p->targetCount[pc] == 2) {
+                snprintf(jump + used, sizeof(jump) - used, " | %u",
+                         p->targets[pc][1]);
+            }
+        } else if (p->jump[pc] == JUMP_UNKNOWN) {
+            snprintf(jump, sizeof(jump), "-> ?");
+        } else if (p->jump[pc] == JUMP_LOAD) {
+            snprintf(jump, sizeof(jump), "-> loads a segment");
+        }
+        if (p->samples != NULL && p->samples[pc] != 0) {
+            printf("%10u  %-32s %-20s %10llu %6.2f%%\n", pc, text, jump,
+                   (unsigned long long)p->samples[pc],
+                   share(p, p->samples[pc]));
+        } else if (jump[0] != '\0') {
+            printf("%10u  %-32s %s\n", pc, text, jump);
+        } else {
+            printf("%10u  %s\n", pc, text);
+        }
+    }
+}
+
+static int by_samples(const void *x, const void *y)
+{
+    const Block *a = x;
+    const Block *b = y;
+    if (a->samples != b->samples) {
+        return a->samples < b->samples ? 1 : -1;
+    }
+    return a->start < b->start ? -1 : a->start > b->start;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *profile = NULL;
+    const char *snapshot = NULL;
+    long long programID = -1;       /* profiled program, -1 for segment 0's */
+    int hot = 0;                    /* blocks shown, 0 for all in order */
+    int opt;
+    while ((opt = getopt(argc, argv, "p:i:n:s:")) != -1) {
+        switch (opt) {
+        case 'p': profile = optarg;                    break;
+        case 'i': programID = atoll(optarg);           break;
+        case 'n': hot = atoi(optarg);                  break;
+        case 's': snapshot = optarg;                   break;
+        default:  usage();
+        }
+    }
+    if ((optind == argc) == (snapshot == NULL) || optind + 1 < argc) {
+        usage();
+    }
+
+    Program p;
+    memset(&p, 0, sizeof(p));
+    const char *name = snapshot;
+    uint32_t loaded = 0;
+    if (snapshot != NULL) {
+        umStorage *mem = snapshot_restore(snapshot);
+        if (!is_mapped(mem, 0)) {
+            fprintf(stderr, "umdump: %s has no segment 0\n", snapshot);
+            return EXIT_FAILURE;
+        }
+        p.words = mem->program;
+        p.length = mem->programLength;
+        p.entry = mem->counter;
+        loaded = mem->programID;
+    } else {
+        name = argv[optind];
+        Segment *seg = load_program(name);
+        if (seg == NULL) {
+            return EXIT_FAILURE;
+        }
+        p.words = seg->words;
+        p.length = seg->length;
+    }
+    if (profile != NULL
+        && !read_profile(&p, profile,
+                         programID < 0 ? loaded : (uint32_t)programID)) {
+        fprintf(stderr, "umdump: cannot read %s\n", profile);
+        return EXIT_FAILURE;
+    }
+    find_blocks(&p);
+
+    int count = 0;
+    Block *blocks = malloc((p.length + 1) * sizeof(*blocks));
+    assert(blocks != NULL);
+    for (uint32_t pc = 0; pc < p.length; pc++) {
+        if (p.leader[pc]) {
+            blocks[count].start = pc;
+            blocks[count].samples = 0;
+            count++;
+        }
+        blocks[count - 1].end = pc + 1;
+        if (p.samples != NULL) {
+            blocks[count - 1].samples += p.samples[pc];
+        }
+    }
+
+    printf("; %s: %u words, %d blocks", name, p.length, count);
+    if (p.samples != NULL) {
+        printf(", %llu samples", (unsigned long long)p.totalSamples);
+    }
+    printf("\n");
+    if (hot > 0) {
+        qsort(blocks, count, sizeof(*blocks), by_samples);
+        if (hot < count) {
+            count = hot;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        print_block(&p, &blocks[i]);
+    }
+    return 0;
+}
\ No newline at end of file
@@ -128,9 +128,9 @@ void Um_write_sequence(FILE *output, Seq_T stream)
 
 Um_instruction three_register(Um_opcode op, int ra, int rb, int rc)
 {
-    assert(ra < 7 && ra >= 0);
-    assert(rb < 7 && rb >= 0);
-    assert(rc < 7 && rc >= 0);
+    assert(ra < 8 && ra >= 0);
+    assert(rb < 8 && rb >= 0);
+    assert(rc < 8 && rc >= 0);
 
     Um_instruction word;
     word = op << 28;
@@ -146,7 +146,7 @@ Um_instruction three_register(Um_opcode op, int ra, int rb, int rc)
 
 Um_instruction loadval(unsigned ra, unsigned val)
 {
-    assert(ra < 7);
+    assert(ra < 8);
     int opCode = LV;
     Um_instruction word;
 
@@ -206,7 +206,12 @@ void build_output_6_test(Seq_T stream)
 }
 
 void build_loadProgram_test(Seq_T stream){
-    append(stream, loadval(r1, 0));
+    /* r1 = 7 << 28, a halt instruction for the new segment 0 */
+    append(stream, loadval(r1, 7));
+    append(stream, loadval(r5, 16777216));
+    append(stream, multiply(r1, r1, r5));
+    append(stream, loadval(r5, 16));
+    append(stream, multiply(r1, r1, r5));
     append(stream, loadval(r4, 0));
     append(stream, loadval(r3, 1));
     append(stream, mapSeg(r2, r3));
@@ -258,14 +263,15 @@ void build_cMov_test(Seq_T stream)
 void build_nand_test(Seq_T stream)
 {
     append(stream, loadval(r4, 10));
-    append(stream, loadval(r1, 39403369));
-    append(stream, loadval(r2, 109));
-    append(stream, multiply(r3, r2, r1));
 
+    /* r1 = 0xffffffff */
     append(stream, loadval(r5, 16843009));
     append(stream, loadval(r2, 255));
     append(stream, multiply(r1, r2, r5));
 
+    /* r3 = ~'J', and nand with all ones flips it back */
+    append(stream, loadval(r2, 74));
+    append(stream, nand(r3, r2, r1));
     append(stream, nand(r2, r3, r1));
     append(stream, output(r2));
     append(stream, output(r4));
@@ -325,9 +331,459 @@ void build_input_test(Seq_T stream)
     append(stream, halt());
 }
 
+static void load_word(Seq_T stream, Um_register target, uint32_t word);
 
+/* A store into segment 0 rewrites another store, which then rewrites a
+ * loadval further on, so the second store only runs once code has been
+ * changed under it; the program prints B. Each part ends with a jump, so a
+ * program compiled by um2c runs the second store in the interpreter.
+ */
+void build_codeStore_test(Seq_T stream)
+{
+    unsigned second = 9;        /* start of the part with the second store */
+    unsigned placeholder = second + 6;
+    unsigned last = second + 9;
+
+    load_word(stream, r4, segStore(r0, r5, r4));
+    append(stream, loadval(r5, placeholder));
+    append(stream, segStore(r0, r5, r4));
+    append(stream, loadval(r5, second));
+    append(stream, loadProg(r0, r5));
+
+    assert((unsigned)Seq_length(stream) == second);
+    load_word(stream, r4, loadval(r3, 'B'));
+    append(stream, loadval(r5, last));
+    append(stream, add(r1, r1, r1));        /* becomes the second store */
+    append(stream, loadval(r5, last));
+    append(stream, loadProg(r0, r5));
+
+    assert((unsigned)Seq_length(stream) == last);
+    append(stream, loadval(r3, 'A'));
+    append(stream, output(r3));
+    append(stream, halt());
+}
+
+/* Random programs for differential testing with um --diff. Every program
+ * runs to its end without failing: r7 holds a scratch segment, r4-r6 are
+ * temporaries, and the random instructions only compute on r0-r3, so
+ * divisors, offsets, output bytes and jump targets can all be made safe.
+ * A quarter of the programs then fail on purpose rather than halt, so the
+ * engines are also compared on how they fail.
+ * The blocks cover the idioms the threaded engine fuses, jumps, loops,
+ * stores into segment 0 and loadProgram of a copy of the program.
+ */
+
+#define SCRATCH_WORDS 256
+#define LOOP_COUNTER (SCRATCH_WORDS - 1)
+#define PROGRAM_LENGTH (SCRATCH_WORDS - 2)
+
+static uint32_t random_state;
+
+static uint32_t random_next(void)
+{
+    /* xorshift32 */
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
 
+static unsigned random_below(unsigned n)
+{
+    return random_next() % n;
+}
 
+static Um_register random_data(void)
+{
+    return random_below(4);
+}
 
+static Um_instruction random_arith(void)
+{
+    static const Um_opcode ops[] = { ADD, MUL, NAND, CMOV };
+    return three_register(ops[random_below(4)], random_data(),
+                          random_data(), random_data());
+}
 
+/* appends instructions leaving a full 32 bit word in target, using r6 */
+static void load_word(Seq_T stream, Um_register target, uint32_t word)
+{
+    append(stream, loadval(target, word >> 16));
+    append(stream, loadval(r6, 65536));
+    append(stream, multiply(target, target, r6));
+    append(stream, loadval(r6, word & 0xffff));
+    append(stream, add(target, target, r6));
+}
 
+/* appends output of the low byte of a data register */
+static void output_byte(Seq_T stream, Um_register data)
+{
+    append(stream, loadval(r6, 255));
+    append(stream, nand(r6, r6, data));
+    append(stream, nand(r6, r6, r6));
+    append(stream, output(r6));
+}
+
+/* appends a loop running a few random instructions a random number of
+ * times, with its counter kept in the scratch segment
+ */
+static void random_loop(Seq_T stream)
+{
+    append(stream, loadval(r6, 1 + random_below(20)));
+    append(stream, loadval(r5, LOOP_COUNTER));
+    append(stream, segStore(r7, r5, r6));
+
+    unsigned top = Seq_length(stream);
+    for (unsigned i = 1 + random_below(6); i > 0; i--) {
+        append(stream, random_arith());
+    }
+    append(stream, loadval(r5, LOOP_COUNTER));
+    append(stream, segLoad(r6, r7, r5));
+    append(stream, loadval(r5, 0));
+    append(stream, nand(r5, r5, r5));
+    append(stream, add(r6, r6, r5));
+    append(stream, loadval(r5, LOOP_COUNTER));
+    append(stream, segStore(r7, r5, r6));
+
+    /* back to the top while the counter is not 0 */
+    unsigned exit = Seq_length(stream) + 5;
+    append(stream, loadval(r4, exit));
+    append(stream, loadval(r5, top));
+    append(stream, cMove(r4, r5, r6));
+    append(stream, loadval(r5, 0));
+    append(stream, loadProg(r5, r4));
+}
+
+/* appends a store into segment 0 that replaces the loadval after it, which
+ * starts a fusable pair, with another instruction
+ */
+static void random_self_modification(Seq_T stream)
+{
+    Um_instruction replacement = random_below(2)
+        ? random_arith() : loadval(random_data(), random_below(1 << 25));
+    load_word(stream, r4, replacement);
+    unsigned target = Seq_length(stream) + 3;
+    append(stream, loadval(r5, target));
+    append(stream, loadval(r6, 0));
+    append(stream, segStore(r6, r5, r4));
+    append(stream, loadval(random_data(), random_below(1 << 25)));
+    append(stream, add(random_data(), random_data(), random_data()));
+}
+
+/* appends a copy of segment 0 into a new segment, a loadProgram of the
+ * copy, which goes on at the word after it, and stores into both segments
+ * while they may still share their words, using r4-r6 and a data register
+ */
+static void random_program_copy(Seq_T stream)
+{
+    Um_register data = random_data();
+    append(stream, loadval(r5, PROGRAM_LENGTH));
+    append(stream, segLoad(r5, r7, r5));
+    append(stream, mapSeg(r4, r5));
+
+    /* copies the words from the last down, while the counter is not 0 */
+    unsigned top = Seq_length(stream);
+    append(stream, loadval(r6, 0));
+    append(stream, nand(r6, r6, r6));
+    append(stream, add(r5, r5, r6));
+    append(stream, loadval(r6, 0));
+    append(stream, segLoad(data, r6, r5));
+    append(stream, segStore(r4, r5, data));
+    unsigned exit = Seq_length(stream) + 5;
+    append(stream, loadval(data, exit));
+    append(stream, loadval(r6, top));
+    append(stream, cMove(data, r6, r5));
+    append(stream, loadval(r6, 0));
+    append(stream, loadProg(r6, data));
+
+    /* the copy's words before the loadProgram never run again */
+    assert((unsigned)Seq_length(stream) == exit);
+    append(stream, loadval(r6, exit + 2));
+    append(stream, loadProg(r4, r6));
+    append(stream, loadval(r5, top + random_below(exit - top)));
+    append(stream, loadval(r6, random_below(1 << 25)));
+    append(stream, segStore(r4, r5, r6));
+    append(stream, loadval(r6, 0));
+    append(stream, segStore(r6, r5, data));
+    append(stream, segLoad(random_data(), r4, r5));
+    append(stream, segLoad(random_data(), r6, r5));
+    append(stream, unmapSeg(r4));
+}
+
+static void random_block(Seq_T stream)
+{
+    Um_register data = random_data();
+    unsigned here = Seq_length(stream);
+    switch (random_below(13)) {
+    case 0:
+        append(stream, loadval(data, random_below(1 << 25)));
+        break;
+    case 1:
+    case 2:
+        append(stream, random_arith());
+        break;
+    case 3:
+        append(stream, loadval(r6, 1 + random_below(1000)));
+        append(stream, divide(data, random_data(), r6));
+        break;
+    case 4:
+        append(stream, loadval(r6, random_below(PROGRAM_LENGTH)));
+        append(stream, segStore(r7, r6, random_data()));
+        break;
+    case 5:
+        append(stream, loadval(r6, random_below(PROGRAM_LENGTH)));
+        append(stream, segLoad(data, r7, r6));
+        break;
+    case 6:
+        output_byte(stream, data);
+        break;
+    case 7:
+        append(stream, loadval(r6, random_below(100)));
+        append(stream, mapSeg(r5, r6));
+        append(stream, unmapSeg(r5));
+        break;
+    case 8:
+        append(stream, input(data));
+        break;
+    case 9:
+        /* skips the next instruction if the data register is not 0 */
+        append(stream, loadval(r5, 0));
+        append(stream, loadval(r4, here + 5));
+        append(stream, loadval(r6, here + 6));
+        append(stream, cMove(r4, r6, data));
+        append(stream, loadProg(r5, r4));
+        append(stream, loadval(data, random_below(1 << 25)));
+        break;
+    case 10:
+        random_loop(stream);
+        break;
+    case 11:
+        random_self_modification(stream);
+        break;
+    case 12:
+        random_program_copy(stream);
+        break;
+    }
+}
+
+/* appends an instruction every engine must fail on, using r4-r6 */
+static void random_failure(Seq_T stream)
+{
+    switch (random_below(4)) {
+    case 0:
+        append(stream, loadval(r6, 0));
+        append(stream, divide(r5, r5, r6));
+        break;
+    case 1:
+        append(stream, loadval(r6, SCRATCH_WORDS + random_below(100)));
+        append(stream, segLoad(r5, r7, r6));
+        break;
+    case 2:
+        append(stream, loadval(r6, SCRATCH_WORDS + random_below(100)));
+        append(stream, segStore(r7, r6, r6));
+        break;
+    case 3:
+        append(stream, loadval(r6, 256 + random_below(1 << 20)));
+        append(stream, output(r6));
+        break;
+    }
+}
+
+void build_random_test(Seq_T stream, uint32_t seed)
+{
+    random_state = seed != 0 ? seed : 1;
+
+    append(stream, loadval(r6, SCRATCH_WORDS));
+    append(stream, mapSeg(r7, r6));
+    unsigned length = Seq_length(stream);
+    append(stream, loadval(r6, 0));         /* the length, once known */
+    append(stream, loadval(r5, PROGRAM_LENGTH));
+    append(stream, segStore(r7, r5, r6));
+    for (Um_register r = r0; r <= r3; r++) {
+        append(stream, loadval(r, random_below(1 << 25)));
+    }
+    for (unsigned i = 20 + random_below(180); i > 0; i--) {
+        random_block(stream);
+    }
+    for (Um_register r = r0; r <= r3; r++) {
+        output_byte(stream, r);
+    }
+    if (random_below(4) == 0) {
+        random_failure(stream);
+    }
+    append(stream, halt());
+    Seq_put(stream, length,
+            (void *)(uintptr_t)loadval(r6, Seq_length(stream)));
+}
+
+/* Microbenchmarks: each is a loop that runs a given number of iterations
+ * of a body made mostly of one kind of instruction, so that the time per
+ * iteration is the cost of that instruction plus a fixed loop overhead.
+ * r7 counts the iterations down, r6 holds ~0 to decrement it and r5 holds
+ * 0 for the jumps; a body may use r0-r2 freely and r3-r4 as temporaries
+ * within one iteration.
+ */
+
+/* appends the loading of the loop registers */
+static void bench_start(Seq_T stream, uint32_t iterations)
+{
+    assert(iterations > 0);
+    load_word(stream, r7, iterations);
+    append(stream, loadval(r5, 0));
+    append(stream, nand(r6, r5, r5));
+}
+
+/* appends the decrement of counter and a jump back to top while it is not
+ * 0, using r3 and r4
+ */
+static void bench_loop(Seq_T stream, unsigned top, Um_register counter)
+{
+    append(stream, add(counter, counter, r6));
+    unsigned exit = Seq_length(stream) + 4;
+    append(stream, loadval(r4, exit));
+    append(stream, loadval(r3, top));
+    append(stream, cMove(r4, r3, counter));
+    append(stream, loadProg(r5, r4));
+}
+
+/* add, multiply, divide, nand, cMove and loadval */
+void build_alu_bench(Seq_T stream, uint32_t iterations, uint32_t size)
+{
+    (void)size;
+    bench_start(stream, iterations);
+    unsigned top = Seq_length(stream);
+    append(stream, add(r0, r0, r7));
+    append(stream, multiply(r1, r1, r0));
+    append(stream, nand(r2, r1, r0));
+    append(stream, divide(r1, r2, r6));
+    append(stream, cMove(r2, r0, r1));
+    append(stream, loadval(r3, 12345));
+    append(stream, add(r0, r0, r3));
+    bench_loop(stream, top, r7);
+    append(stream, halt());
+}
+
+/* appends the start of a stream through a segment of size words (a power
+ * of two of at least 8) in r0: r1 is the first of the 8 words the
+ * iteration reaches, and r4 is 1
+ */
+static unsigned stream_start(Seq_T stream, uint32_t iterations,
+                             uint32_t size)
+{
+    assert(size >= 8 && (size & (size - 1)) == 0 && size < (1u << 25));
+    bench_start(stream, iterations);
+    append(stream, loadval(r3, size));
+    append(stream, mapSeg(r0, r3));
+
+    unsigned top = Seq_length(stream);
+    append(stream, loadval(r4, 8));
+    append(stream, multiply(r1, r7, r4));
+    append(stream, loadval(r3, size - 8));
+    append(stream, nand(r1, r1, r3));
+    append(stream, nand(r1, r1, r1));
+    append(stream, loadval(r4, 1));
+    return top;
+}
+
+/* 8 segLoads per iteration, streaming through a segment of size words */
+void build_segLoad_bench(Seq_T stream, uint32_t iterations, uint32_t size)
+{
+    unsigned top = stream_start(stream, iterations, size);
+    for (int i = 0; i < 8; i++) {
+        append(stream, segLoad(r2, r0, r1));
+        append(stream, add(r1, r1, r4));
+    }
+    bench_loop(stream, top, r7);
+    append(stream, halt());
+}
+
+/* 8 segStores per iteration, streaming through a segment of size words */
+void build_segStore_bench(Seq_T stream, uint32_t iterations, uint32_t size)
+{
+    unsigned top = stream_start(stream, iterations, size);
+    for (int i = 0; i < 8; i++) {
+        append(stream, segStore(r0, r1, r7));
+        append(stream, add(r1, r1, r4));
+    }
+    bench_loop(stream, top, r7);
+    append(stream, halt());
+}
+
+/* 2 maps and 2 unmaps of segments of size words per iteration */
+void build_map_bench(Seq_T stream, uint32_t iterations, uint32_t size)
+{
+    assert(size < (1u << 25));
+    bench_start(stream, iterations);
+    append(stream, loadval(r2, size));
+    unsigned top = Seq_length(stream);
+    append(stream, mapSeg(r0, r2));
+    append(stream, mapSeg(r1, r2));
+    append(stream, unmapSeg(r0));
+    append(stream, unmapSeg(r1));
+    bench_loop(stream, top, r7);
+    append(stream, halt());
+}
+
+/* 8 loadProgram jumps within segment 0 per iteration, each from a loadval
+ * of its target
+ */
+void build_jump_bench(Seq_T stream, uint32_t iterations, uint32_t size)
+{
+    (void)size;
+    bench_start(stream, iterations);
+    unsigned top = Seq_length(stream);
+    for (int i = 0; i < 8; i++) {
+        append(stream, loadval(r3, Seq_length(stream) + 2));
+        append(stream, loadProg(r5, r3));
+    }
+    bench_loop(stream, top, r7);
+    append(stream, halt());
+}
+
+/* one loadProgram of a program of size words per iteration. The program
+ * is padded with halts to size words and copied into the segment in r0
+ * first; every iteration loads that copy and then stores a word of segment
+ * 0 back unchanged, so that a um sharing the words of a loaded segment
+ * still has to copy them.
+ */
+void build_loadProgram_bench(Seq_T stream, uint32_t iterations,
+                             uint32_t size)
+{
+    assert(size < (1u << 25));
+    bench_start(stream, iterations);
+    append(stream, loadval(r1, size));
+    append(stream, mapSeg(r0, r1));
+    unsigned copy = Seq_length(stream);
+    append(stream, add(r2, r1, r6));
+    append(stream, segLoad(r3, r5, r2));
+    append(stream, segStore(r0, r2, r3));
+    bench_loop(stream, copy, r1);
+
+    unsigned top = Seq_length(stream);
+    append(stream, loadval(r3, top + 2));
+    append(stream, loadProg(r0, r3));
+    append(stream, loadval(r3, size - 1));
+    append(stream, segLoad(r4, r5, r3));
+    append(stream, segStore(r5, r3, r4));
+    bench_loop(stream, top, r7);
+    while ((uint32_t)Seq_length(stream) < size) {
+        append(stream, halt());
+    }
+    assert((uint32_t)Seq_length(stream) == size);
+}
+
+/* 3 outputs per iteration, printing "UM\n" */
+void build_output_bench(Seq_T stream, uint32_t iterations, uint32_t size)
+{
+    (void)size;
+    bench_start(stream, iterations);
+    append(stream, loadval(r0, 'U'));
+    append(stream, loadval(r1, 'M'));
+    append(stream, loadval(r2, '\n'));
+    unsigned top = Seq_length(stream);
+    append(stream, output(r0));
+    append(stream, output(r1));
+    append(stream, output(r2));
+    bench_loop(stream, top, r7);
+    append(stream, halt());
+}
@@ -1,4 +1,5 @@
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -25,6 +26,20 @@ extern void build_segLoad_test(Seq_T stream);
 extern void build_segStore_test(Seq_T stream);
 extern void build_input_test(Seq_T stream);
 extern void build_loadProgram_test(Seq_T stream);
+extern void build_codeStore_test(Seq_T stream);
+extern void build_random_test(Seq_T stream, uint32_t seed);
+
+extern void build_alu_bench(Seq_T stream, uint32_t iterations, uint32_t size);
+extern void build_segLoad_bench(Seq_T stream, uint32_t iterations,
+                                uint32_t size);
+extern void build_segStore_bench(Seq_T stream, uint32_t iterations,
+                                 uint32_t size);
+extern void build_map_bench(Seq_T stream, uint32_t iterations, uint32_t size);
+extern void build_jump_bench(Seq_T stream, uint32_t iterations, uint32_t size);
+extern void build_loadProgram_bench(Seq_T stream, uint32_t iterations,
+                                    uint32_t size);
+extern void build_output_bench(Seq_T stream, uint32_t iterations,
+                               uint32_t size);
 
 
 /* The array `tests` contains all unit tests for the lab. */
@@ -41,21 +56,50 @@ static struct test_info {
         { "halt-verbose", NULL, "",  build_verbose_halt_test },
         { "add",          NULL, "",  build_add_test },
         { "print-six",    NULL, "6", build_output_6_test},
-        { "mul",          NULL, "2", build_mulTo2_test},
-        { "div",          NULL, "4", build_divTo4_test},
-        { "cMov",         NULL, "",  build_cMov_test},
-        { "nand",         NULL, "",  build_nand_test},
+        { "mul",          NULL, "2\n", build_mulTo2_test},
+        { "div",          NULL, "4\n", build_divTo4_test},
+        { "cMov",         NULL, "4\nQ\n", build_cMov_test},
+        { "nand",         NULL, "J\n", build_nand_test},
         { "map",          NULL, "",  build_map_test},
         { "unmap",        NULL, "",  build_unmap_test},
         { "remap",        NULL, "",  build_remap_test},
         { "store",        NULL, "",  build_segStore_test},
-        { "input",        NULL, "",  build_input_test},
-        { "loadProg",     NULL, "",  build_loadProgram_test}
+        { "input",        "x",  "x", build_input_test},
+        { "loadProg",     NULL, "",  build_loadProgram_test},
+        { "codeStore",    NULL, "B", build_codeStore_test}
 };
 
   
 #define NTESTS (sizeof(tests)/sizeof(tests[0]))
 
+/*
+ * The array `benches` contains the microbenchmarks.  Each runs a loop
+ * around one kind of instruction; given N iterations, it runs N / cost of
+ * them (at least one), so that every benchmark takes roughly as long.
+ */
+
+static struct bench_info {
+        const char *name;
+        uint32_t size;          /* words mapped, streamed through or loaded */
+        uint32_t cost;
+        const char *line;       /* printed by every iteration, or NULL */
+        void (*build_bench)(Seq_T stream, uint32_t iterations,
+                            uint32_t size);
+} benches[] = {
+        { "bench-alu",       0,       1,    NULL,   build_alu_bench },
+        { "bench-segLoad",   1 << 16, 1,    NULL,   build_segLoad_bench },
+        { "bench-segStore",  1 << 16, 1,    NULL,   build_segStore_bench },
+        { "bench-map-1",     1,       1,    NULL,   build_map_bench },
+        { "bench-map-64",    64,      1,    NULL,   build_map_bench },
+        { "bench-map-1024",  1024,    2,    NULL,   build_map_bench },
+        { "bench-map-65536", 65536,   256,  NULL,   build_map_bench },
+        { "bench-jump",      0,       1,    NULL,   build_jump_bench },
+        { "bench-loadProg",  4096,    1024, NULL,   build_loadProgram_bench },
+        { "bench-output",    0,       1,    "UM\n", build_output_bench }
+};
+
+#define NBENCHES (sizeof(benches)/sizeof(benches[0]))
+
 /*
  * open file 'path' for writing, then free the pathname;
  * if anything fails, checked runtime error
@@ -70,10 +114,42 @@ static void write_or_remove_file(char *path, const char *contents);
 
 static void write_test_files(struct test_info *test);
 
+/*
+ * write 'count' random programs fuzz-0.um, fuzz-1.um, ... for um --diff;
+ * the same seed always writes the same programs
+ */
+static void write_random_tests(int count, uint32_t seed);
+
+/*
+ * write the microbenchmark 'bench' with N iterations as NAME.um, and what
+ * it prints as NAME.1
+ */
+static void write_bench_files(struct bench_info *bench, uint32_t n);
+
+/*
+ * write the microbenchmarks named in argv (all of them when there are
+ * none) with 'n' iterations; returns nonzero if a name is unknown
+ */
+static bool write_benches(int argc, char *argv[], uint32_t n);
+
 
 int main (int argc, char *argv[])
 {
         bool failed = false;
+        if (argc > 1 && !strncmp(argv[1], "--fuzz=", 7)) {
+                write_random_tests(atoi(argv[1] + 7),
+                                   argc > 2 ? strtoul(argv[2], NULL, 10) : 1);
+                return 0;
+        }
+        if (argc > 1 && !strncmp(argv[1], "--bench=", 8)) {
+                uint32_t n = strtoul(argv[1] + 8, NULL, 10);
+                if (n == 0) {
+                        fprintf(stderr, "***** Bad iteration count %s *****\n",
+                                argv[1] + 8);
+                        return 1;
+                }
+                return write_benches(argc - 2, argv + 2, n);
+        }
         if (argc == 1)
                 for (unsigned i = 0; i < NTESTS; i++) {
                         printf("***** Writing test '%s'.\n", tests[i].name);
@@ -114,6 +190,73 @@ static void write_test_files(struct test_info *test)
 }
 
 
+static void write_random_tests(int count, uint32_t seed)
+{
+        for (int i = 0; i < count; i++) {
+                printf("***** Writing random test %d.\n", i);
+                FILE *binary = open_and_free_pathname(
+                        Fmt_string("fuzz-%d.um", i));
+                Seq_T instructions = Seq_new(0);
+                build_random_test(instructions, seed * 1000003u + i);
+                Um_write_sequence(binary, instructions);
+                Seq_free(&instructions);
+                fclose(binary);
+        }
+}
+
+
+static bool write_benches(int argc, char *argv[], uint32_t n)
+{
+        bool failed = false;
+        if (argc == 0)
+                for (unsigned i = 0; i < NBENCHES; i++) {
+                        printf("***** Writing benchmark '%s'.\n",
+                               benches[i].name);
+                        write_bench_files(&benches[i], n);
+                }
+        for (int j = 0; j < argc; j++) {
+                bool written = false;
+                for (unsigned i = 0; i < NBENCHES; i++)
+                        if (!strcmp(benches[i].name, argv[j])) {
+                                written = true;
+                                write_bench_files(&benches[i], n);
+                        }
+                if (!written) {
+                        failed = true;
+                        fprintf(stderr, "***** No benchmark named %s *****\n",
+                                argv[j]);
+                }
+        }
+        return failed;
+}
+
+
+static void write_bench_files(struct bench_info *bench, uint32_t n)
+{
+        uint32_t iterations = n / bench->cost > 0 ? n / bench->cost : 1;
+        FILE *binary = open_and_free_pathname(Fmt_string("%s.um",
+                                                         bench->name));
+        Seq_T instructions = Seq_new(0);
+        bench->build_bench(instructions, iterations, bench->size);
+        Um_write_sequence(binary, instructions);
+        Seq_free(&instructions);
+        fclose(binary);
+
+        char *expected = NULL;
+        if (bench->line != NULL) {
+                size_t length = strlen(bench->line);
+                expected = malloc(length * iterations + 1);
+                assert(expected != NULL);
+                for (uint32_t i = 0; i < iterations; i++)
+                        memcpy(expected + length * i, bench->line, length);
+                expected[length * iterations] = '\0';
+        }
+        write_or_remove_file(Fmt_string("%s.0", bench->name), NULL);
+        write_or_remove_file(Fmt_string("%s.1", bench->name), expected);
+        free(expected);
+}
+
+
 static void write_or_remove_file(char *path, const char *contents)
 {
         if (contents == NULL || *contents == '\0') {